@@ -15,6 +15,103 @@ namespace nmj
 
 		/* Enable depth testing. */
 		RasterizerFlagDepthTest = 0x00000004,
+
+		/* Enable stencil testing and operations. Requires RasterizerDepthFormatD24S8. */
+		RasterizerFlagStencilTest = 0x00000008,
+
+		/* Discard pixels with alpha less than the alpha reference, before depth and stencil writes. */
+		RasterizerFlagAlphaTest = 0x00000010,
+	};
+
+	/**
+	 * Comparison functions for the depth and stencil tests.
+	 *
+	 * Depth test compares the pixel depth against the depth buffer and stencil test
+	 * compares the reference value against the stencil buffer, both after masking.
+	 */
+	enum
+	{
+		/* Pass, when the value is less than the buffer. */
+		RasterizerCompareLess,
+
+		/* Pass, when the value is less than or equal to the buffer. */
+		RasterizerCompareLessEqual,
+
+		/* Pass, when the value is greater than the buffer. Use for depth with reversed depth range. */
+		RasterizerCompareGreater,
+
+		/* Pass, when the value equals the buffer. Useful for shading after depth prepass. */
+		RasterizerCompareEqual,
+
+		/* Always pass. */
+		RasterizerCompareAlways,
+	};
+
+	/**
+	 * Stencil buffer operations.
+	 */
+	enum
+	{
+		/* Keep the current value. */
+		RasterizerStencilKeep,
+
+		/* Set the value to zero. */
+		RasterizerStencilZero,
+
+		/* Set the value to the reference value. */
+		RasterizerStencilReplace,
+
+		/* Increment the value, clamping to 255. */
+		RasterizerStencilIncr,
+
+		/* Decrement the value, clamping to 0. */
+		RasterizerStencilDecr,
+
+		/* Invert the bits of the value. */
+		RasterizerStencilInvert,
+	};
+
+	/**
+	 * Color blending of the pixels with the color buffer.
+	 *
+	 * The same blending is applied to all four channels, including alpha. Triangles
+	 * are blended in the order of the inputs and their indices, since each tile is
+	 * rasterized by one split from the first to the last triangle.
+	 */
+	enum
+	{
+		/* Overwrite the color buffer. */
+		RasterizerBlendNone,
+
+		/* Blend with source alpha: src * a + dst * (1 - a). */
+		RasterizerBlendAlpha,
+
+		/* Add to the color buffer with saturation: src + dst. */
+		RasterizerBlendAdditive,
+
+		/* Blend color premultiplied with alpha: src + dst * (1 - a). */
+		RasterizerBlendPremultiplied,
+
+		/* Multiply the color buffer: src * dst. */
+		RasterizerBlendMultiply,
+	};
+
+	enum
+	{
+		/* 24bit unsigned normalized depth with 8bit stencil. */
+		RasterizerDepthFormatD24S8,
+
+		/* 16bit unsigned normalized depth. Halves the memory traffic of depth only passes. */
+		RasterizerDepthFormatD16,
+
+		/* 32bit floating point depth. Use with RasterizerCompareGreater and reversed depth range for best precision. */
+		RasterizerDepthFormatD32F,
+	};
+
+	enum
+	{
+		/* Maximum number of splits supported by the occlusion queries. */
+		RasterizerMaxSplits = 64,
 	};
 
 	/**
@@ -59,13 +156,21 @@ namespace nmj
 		void *color_buffer;
 
 		/**
-		 * 24bit unsigned normalized depth buffer with 8bit stencil buffer.
+		 * Depth buffer in the format specified by depth_format.
 		 * 16 byte alignment is required.
 		 *
-		 * The memory is packed as 2x2 pixels block in following layout:
+		 * The memory is packed as 2x2 pixels block in following layout, with
+		 * RasterizerDepthFormatD24S8:
 		 * 00: D1 S1 D2 S2
 		 * 08: D3 S3 D4 S4
 		 *
+		 * RasterizerDepthFormatD16:
+		 * 00: D1 D2 D3 D4
+		 *
+		 * RasterizerDepthFormatD32F:
+		 * 00: D1 D2
+		 * 08: D3 D4
+		 *
 		 * From screen-space layout of:
 		 *  -------- X
 		 * | DS1 DS2 
@@ -74,12 +179,228 @@ namespace nmj
 		 */
 		void *depth_buffer;
 
+		/**
+		 * Hierarchical depth buffer, with the nearest and farthest depth value of
+		 * each tile. Optional, can be NULL.
+		 *
+		 * Values are stored as 32bit integers in the depth buffer format, without
+		 * stencil. ClearDepth resets it and depth writes keep it up to date. Depth
+		 * tested triangles that fail the test for the whole tile are rejected
+		 * without rasterizing them.
+		 */
+		U32 *hiz_buffer;
+
+		/**
+		 * Depth buffer format.
+		 */
+		U32 depth_format;
+
 		/**
 		 * Output resolution.
 		 */
 		U16 width, height;
 	};
 
+	/**
+	 * Texture addressing for the texture coordinates outside [0, 1].
+	 */
+	enum
+	{
+		/* Repeat the texture. */
+		RasterizerAddressWrap,
+
+		/* Repeat the edge texels. */
+		RasterizerAddressClamp,
+
+		/* Repeat the texture mirrored every other time. */
+		RasterizerAddressMirror,
+	};
+
+	/**
+	 * Texture filtering within mip level.
+	 */
+	enum
+	{
+		/* Sample the nearest texel. */
+		RasterizerFilterNearest,
+
+		/* Blend the 2x2 nearest texels. */
+		RasterizerFilterBilinear,
+	};
+
+	/**
+	 * Filtering between texture mip levels.
+	 */
+	enum
+	{
+		/* Sample the nearest mip level. */
+		RasterizerMipFilterNearest,
+
+		/* Blend between the two nearest mip levels, for trilinear filtering. */
+		RasterizerMipFilterLinear,
+	};
+
+	/**
+	 * Texture formats.
+	 */
+	enum
+	{
+		/* 32bit RGBA with red in the lowest byte, same as the color buffer. */
+		RasterizerTextureFormatRGBA8,
+
+		/* BC1 (DXT1) compressed 4x4 texel blocks of 8 bytes, with 1bit alpha. */
+		RasterizerTextureFormatBC1,
+
+		/* BC3 (DXT5) compressed 4x4 texel blocks of 16 bytes, with interpolated alpha. */
+		RasterizerTextureFormatBC3,
+	};
+
+	/**
+	 * Texel memory layouts of uncompressed textures.
+	 */
+	enum
+	{
+		/* Texels in row-major order. */
+		RasterizerTextureLayoutLinear,
+
+		/**
+		 * Texels in 4x4 tiles of 64 bytes, with the tiles and the texels in the tiles
+		 * in row-major order. Levels smaller than 4 texels use the level width or height
+		 * as the tile size. Neighbouring texels stay in the same cache line, no matter
+		 * the sampling direction.
+		 */
+		RasterizerTextureLayoutTiled,
+	};
+
+	/**
+	 * Texture for the diffuse map.
+	 *
+	 * Width and height must be powers of two. Sampling is configured separately with
+	 * RasterizerSampler.
+	 *
+	 * Compressed textures have their blocks in row-major order, ignoring the layout,
+	 * and levels smaller than a block take a full block. Blocks are decoded when
+	 * sampled and the decoded blocks are reused within the tile.
+	 *
+	 * Mip level is selected per 2x2 pixel block from the texture coordinate
+	 * derivatives. GenerateMipChain can be used to create the levels.
+	 */
+	struct RasterizerTexture
+	{
+		/**
+		 * Texel data in the texture layout. Mip levels are stored one after another
+		 * starting from level 0, each level halving the resolution down to 1x1.
+		 */
+		const void *texels;
+
+		/* Texture resolution of level 0. */
+		U16 width, height;
+
+		/* Number of mip levels. Zero or one disables mipmapping. */
+		U8 mip_count;
+
+		/* Texel memory layout. */
+		U8 layout;
+
+		/* Texture format. */
+		U8 format;
+	};
+
+	/**
+	 * Texture sampler state.
+	 *
+	 * Address mode and filter select specialized pipeline variants, so they don't
+	 * cost per pixel branching.
+	 */
+	struct RasterizerSampler
+	{
+		/* Addressing of the texture coordinates. */
+		U8 address_mode;
+
+		/* Filtering within mip level. */
+		U8 filter;
+
+		/* Filtering between the mip levels. */
+		U8 mip_filter;
+	};
+
+	/**
+	 * Lighting models.
+	 */
+	enum
+	{
+		/* Output the unlit color. */
+		RasterizerLightingNone,
+
+		/* Diffuse lighting. */
+		RasterizerLightingLambert,
+
+		/* Diffuse lighting with Blinn-Phong specular highlights. */
+		RasterizerLightingBlinnPhong,
+	};
+
+	/**
+	 * Light types.
+	 */
+	enum
+	{
+		/* Light from a direction, without attenuation. */
+		RasterizerLightDirectional,
+
+		/* Light from a position, attenuated to zero at the range. */
+		RasterizerLightPoint,
+	};
+
+	enum
+	{
+		/* Maximum number of lights per input. */
+		RasterizerMaxLights = 8,
+	};
+
+	/**
+	 * Light source.
+	 */
+	struct RasterizerLight
+	{
+		U32 type;
+
+		/* Position of point light or normalized direction towards directional light. */
+		float position[3];
+
+		/* Light color. */
+		float color[3];
+
+		/* Range of point light. */
+		float range;
+	};
+
+	/**
+	 * Per pixel lighting state.
+	 *
+	 * Lighting is evaluated in the space of the vertices, before the transform, so
+	 * the lights and the eye position must be given in that space. The lit color is
+	 * the unlit color modulated with the ambient and diffuse light, and the specular
+	 * light is added on top of it. Lighting saturates at one.
+	 */
+	struct RasterizerLighting
+	{
+		/* Lighting model. */
+		U32 model;
+
+		/* Ambient light color. */
+		float ambient[3];
+
+		/* Specular color and power of the Blinn-Phong model. */
+		float specular[3];
+		float specular_power;
+
+		/* Eye position for the Blinn-Phong model. */
+		float eye_position[3];
+
+		RasterizerLight lights[RasterizerMaxLights];
+		U32 light_count;
+	};
+
 	/**
 	 * Rasterizer input data.
 	 */
@@ -95,6 +416,22 @@ namespace nmj
 		const float *vertices; // xyz per vertex
 		const float *colors;   // rgba per vertex
 		const float *texcoords; // xy per vertex
+		const float *normals; // xyz per vertex
+
+		/**
+		 * Diffuse texture sampled with texcoords and modulated with the vertex colors.
+		 * Optional, can be NULL.
+		 */
+		const RasterizerTexture *diffuse_map;
+
+		/* Sampler state for the diffuse map. */
+		RasterizerSampler diffuse_sampler;
+
+		/**
+		 * Lighting with the normals, used with RasterizerFlagColorWrite.
+		 * Optional, can be NULL.
+		 */
+		const RasterizerLighting *lighting;
 
 		/* Vertex indices for the triangles. */
 		const U16 *indices;
@@ -103,6 +440,26 @@ namespace nmj
 		U32 triangle_count;
 	};
 
+	/**
+	 * Occlusion query.
+	 *
+	 * Counts the pixels that pass the depth test for the draws issued between
+	 * BeginQuery and EndQuery. Each split has its own counter, so the splits can be
+	 * processed in parallel without synchronization. The counters are merged with
+	 * GetQueryResult, after all the splits have finished.
+	 */
+	struct RasterizerQuery
+	{
+		/* Per split counter, padded to cache line to avoid false sharing. */
+		struct Counter
+		{
+			U32 samples;
+			U32 padding[15];
+		};
+
+		Counter counters[RasterizerMaxSplits];
+	};
+
 	/**
 	 * Rasterizer state.
 	 */
@@ -110,11 +467,50 @@ namespace nmj
 	{
 		RasterizerOutput *output;
 		U32 flags;
+
+		/* Depth test comparison function. */
+		U32 depth_compare;
+
+		/**
+		 * Color blending, used with RasterizerFlagColorWrite.
+		 *
+		 * Source alpha comes from the vertex colors modulated with the diffuse map.
+		 * Without either, pixels are opaque white.
+		 */
+		U32 blend_mode;
+
+		/**
+		 * Alpha test reference, used with RasterizerFlagAlphaTest.
+		 *
+		 * Pixels pass, when their alpha is greater than or equal to the reference.
+		 * Alpha comes from the same source as with blending, so draws without vertex
+		 * colors and the diffuse map always pass.
+		 */
+		U8 alpha_ref;
+
+		/**
+		 * Stencil test state, used with RasterizerFlagStencilTest.
+		 *
+		 * Reference and stencil values are masked with the read mask before the
+		 * comparison, and only bits of the write mask are modified. The operation
+		 * is chosen by whether the stencil test fails, the stencil test passes but
+		 * depth test fails, or both pass.
+		 */
+		U32 stencil_compare;
+		U32 stencil_fail_op;
+		U32 stencil_depth_fail_op;
+		U32 stencil_pass_op;
+		U8 stencil_ref;
+		U8 stencil_read_mask;
+		U8 stencil_write_mask;
+
+		/* Active occlusion query or NULL. */
+		RasterizerQuery *query;
 	};
 
 	/**
 	 * Get required memory amount for the rasterization output.
-	 * Width and height must be specified before calling this.
+	 * Width, height and depth format must be specified before calling this.
 	 *
 	 * This is helper util and completely optional.
 	 */
@@ -122,20 +518,81 @@ namespace nmj
 
 	/**
 	 * Initialize rasterizer output.
-	 * Width and height must be specified before calling this.
+	 * Width, height and depth format must be specified before calling this.
+	 *
+	 * Hierarchical depth buffer is allocated with the depth buffer.
 	 *
 	 * This is helper util and completely optional.
 	 */
 	void Initialize(RasterizerOutput &self, void *memory, bool color, bool depth);
 
+	/**
+	 * Get required memory amount for the texels of the texture.
+	 * Width and height must be specified before calling this.
+	 *
+	 * With mipmaps, the memory includes the full mip chain down to 1x1.
+	 *
+	 * This is helper util and completely optional.
+	 */
+	U32 GetRequiredMemoryAmount(const RasterizerTexture &self, bool mipmaps);
+
+	/**
+	 * Generate the full mip chain of the texture with 2x2 box filter.
+	 * Width and height must be specified before calling this.
+	 *
+	 * Level 0 is read from the beginning of texels and the other levels are
+	 * written after it, so texels must have room for the full mip chain. Sets the
+	 * texels and the mip count of the texture. Texels must be in linear layout and
+	 * RasterizerTextureFormatRGBA8, so generate the mip chain before
+	 * ConvertToTiledLayout.
+	 */
+	void GenerateMipChain(RasterizerTexture &self, U32 *texels);
+
+	/**
+	 * Convert linear RasterizerTextureFormatRGBA8 texels to RasterizerTextureLayoutTiled
+	 * for faster sampling.
+	 * Width, height and mip count must be specified before calling this.
+	 *
+	 * All mip levels are converted from the texture texels to tiled_texels, which
+	 * must not overlap them. Sets the texels and the layout of the texture.
+	 */
+	void ConvertToTiledLayout(RasterizerTexture &self, U32 *tiled_texels);
+
 	/**
 	 * Transform number of triangles to rasterized buffers.
 	 *
 	 * You can split the work into N amount of calls, which can be processed
 	 * in parallel.
+	 *
+	 * For scenes with heavy overdraw, first rasterize only with RasterizerFlagDepthWrite
+	 * and RasterizerFlagDepthTest, which uses a dedicated depth only pipeline. Then
+	 * rasterize again with RasterizerFlagColorWrite and RasterizerFlagDepthTest using
+	 * RasterizerCompareEqual, so that each pixel is shaded once. Alpha tested draws
+	 * need RasterizerFlagAlphaTest in the depth only pass too, which then samples
+	 * the alpha with the general pipeline.
 	 */
 	void Rasterize(RasterizerState &state, const RasterizerInput *input, U32 input_count, U32 split_index = 0, U32 num_splits = 1);
 
+	/**
+	 * Begin counting visible pixels of the following Rasterize calls to the query.
+	 *
+	 * Must be called for each split that rasterizes the draws. Rasterizing with
+	 * only RasterizerFlagDepthTest set uses a dedicated depth test only pipeline.
+	 */
+	void BeginQuery(RasterizerState &state, RasterizerQuery &query, U32 split_index = 0);
+
+	/**
+	 * Stop counting visible pixels to the active query.
+	 */
+	void EndQuery(RasterizerState &state);
+
+	/**
+	 * Merge the visible pixel counts of all splits.
+	 *
+	 * All the splits must have finished their queries before calling this.
+	 */
+	U32 GetQueryResult(const RasterizerQuery &query, U32 num_splits = 1);
+
 	/**
 	 * Clear color buffer
 	 *
@@ -147,6 +604,8 @@ namespace nmj
 	/**
 	 * Clear depth buffer
 	 *
+	 * Stencil is ignored for formats without stencil.
+	 *
 	 * You can split the work into N amount of calls, which can be processed
 	 * in parallel.
 	 */
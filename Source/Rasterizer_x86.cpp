@@ -14,13 +14,11 @@ namespace nmj
 
 	// Buffer settings
 	enum { ColorBytes = 4 };
-	enum { DepthBytes = 4 };
 
 	// SIMD block settings
 	enum { BlockSizeX = 2 };
 	enum { BlockSizeY = 2 };
 	enum { ColorBlockBytes = BlockSizeX * BlockSizeY * ColorBytes };
-	enum { DepthBlockBytes = BlockSizeX * BlockSizeY * DepthBytes };
 
 	// Tile settings
 	enum { MaxTrianglesPerTile = 4096 }; // TODO: Make this dynamic.
@@ -29,9 +27,7 @@ namespace nmj
 	enum { TileSizeXInBlocks = TileSizeX / BlockSizeX };
 	enum { TileSizeYInBlocks = TileSizeY / BlockSizeY };
 	enum { ColorTilePitch = TileSizeXInBlocks * ColorBlockBytes };
-	enum { DepthTilePitch = TileSizeXInBlocks * DepthBlockBytes };
 	enum { ColorTileBytes = TileSizeX * TileSizeY * ColorBytes };
-	enum { DepthTileBytes = TileSizeX * TileSizeY * DepthBytes };
 
 #if 0
 	// Triangle bin
@@ -48,12 +44,40 @@ namespace nmj
 	};
 #endif
 
+	// Draw state for the tile rasterizers, that is prepared once per Rasterize call.
+	struct DrawState
+	{
+		// Stencil reference value masked with the read mask.
+		__m128i stencil_ref;
+		__m128i stencil_read_mask;
+		__m128i stencil_write_mask;
+
+		// Enabled results of the stencil comparison, for reference less than, equal or
+		// greater than the stencil value.
+		__m128i stencil_test_less;
+		__m128i stencil_test_equal;
+		__m128i stencil_test_greater;
+
+		// Stencil operations as ((value & and) ^ xor) + add, for [fail, depth fail, pass].
+		__m128i stencil_op_and[3];
+		__m128i stencil_op_xor[3];
+		__m128i stencil_op_add[3];
+
+		// Stencil is not modified by pixels failing the depth test, so the triangles can
+		// be rejected with the hierarchical depth buffer.
+		bool stencil_allows_hiz;
+
+		// Alpha test reference value.
+		__m128i alpha_ref;
+	};
+
 	// Function type for the RasterizeTile function.
-	typedef void RasterizeTileFunc(
+	// Returns the number of pixels that passed the depth test.
+	typedef U32 RasterizeTileFunc(
 		U32 tile_x, U32 tile_y,
 		U32 screen_width, U32 screen_height,
-		void *color_buffer, void *depth_buffer,
-		const RasterizerInput &input
+		void *color_buffer, void *depth_buffer, U32 *hiz,
+		const DrawState &draw, const RasterizerInput &input
 	);
 
 	NMJ_FORCEINLINE S32 Max(S32 a, S32 b)
@@ -74,12 +98,280 @@ namespace nmj
 		return _mm_unpacklo_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 0, 2, 0)));
 	}
 
-	// Use template to easily generate multiple functions with different rasterizer state.
-	template <bool ColorWrite, bool DepthWrite, bool DepthTest, bool DiffuseMap, bool VertexColor>
-	static void RasterizeTile(
+	// Signed max for SSE epi32 integer vectors.
+	NMJ_FORCEINLINE __m128i MaxEpi32(__m128i a, __m128i b)
+	{
+		__m128i mask = _mm_cmpgt_epi32(a, b);
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	// Signed min for SSE epi32 integer vectors.
+	NMJ_FORCEINLINE __m128i MinEpi32(__m128i a, __m128i b)
+	{
+		__m128i mask = _mm_cmpgt_epi32(a, b);
+		return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+	}
+
+	// Depth buffer memory layout for the pixel size.
+	template <U32 PixelBytesT>
+	struct DepthLayout
+	{
+		enum { PixelBytes = PixelBytesT };
+		enum { BlockBytes = BlockSizeX * BlockSizeY * PixelBytes };
+		enum { TilePitch = TileSizeXInBlocks * BlockBytes };
+		enum { TileBytes = TileSizeX * TileSizeY * PixelBytes };
+	};
+
+	// Depth buffer formats.
+	//
+	// All the formats handle depth values of a 2x2 block as 32bit integers in SIMD
+	// registers, so that the same integer comparisons work for all of them. Floating
+	// point depth is never negative, so its bit pattern orders the same way as integers.
+	template <U32 Format>
+	struct DepthBufferFormat;
+
+	template <>
+	struct DepthBufferFormat<RasterizerDepthFormatD24S8> : DepthLayout<4>
+	{
+		enum { MaxValue = 0xFFFFFF };
+
+		// Load raw depth buffer values of a 2x2 block.
+		static NMJ_FORCEINLINE __m128i Load(const void *in)
+		{
+			return _mm_load_si128((const __m128i *)in);
+		}
+
+		// Store raw depth buffer values of a 2x2 block.
+		static NMJ_FORCEINLINE void Store(void *out, __m128i raw)
+		{
+			_mm_store_si128((__m128i *)out, raw);
+		}
+
+		// Get depth values from the raw values.
+		static NMJ_FORCEINLINE __m128i GetDepth(__m128i raw)
+		{
+			return _mm_and_si128(raw, _mm_set1_epi32(MaxValue));
+		}
+
+		// Replace depth of the masked pixels, without touching the stencil.
+		static NMJ_FORCEINLINE __m128i SetDepth(__m128i raw, __m128i depth, __m128i mask)
+		{
+			__m128i depth_mask = _mm_and_si128(mask, _mm_set1_epi32(MaxValue));
+			return _mm_or_si128(_mm_andnot_si128(depth_mask, raw), _mm_and_si128(mask, depth));
+		}
+
+		// Convert normalized depth to depth values.
+		static NMJ_FORCEINLINE __m128i Encode(__m128 z)
+		{
+			__m128i depth = _mm_cvtps_epi32(_mm_mul_ps(z, _mm_set1_ps(float(MaxValue))));
+			return MinEpi32(MaxEpi32(depth, _mm_setzero_si128()), _mm_set1_epi32(MaxValue));
+		}
+
+		static NMJ_FORCEINLINE S32 Encode(float z)
+		{
+			return Min(Max(_mm_cvtss_si32(_mm_mul_ss(_mm_set_ss(z), _mm_set_ss(float(MaxValue)))), 0), MaxValue);
+		}
+
+		// Raw value for clearing a 2x2 block.
+		static NMJ_FORCEINLINE __m128i GetClearValue(float depth, U8 stencil)
+		{
+			return _mm_set1_epi32(Encode(depth) | stencil << 24);
+		}
+	};
+
+	template <>
+	struct DepthBufferFormat<RasterizerDepthFormatD16> : DepthLayout<2>
+	{
+		enum { MaxValue = 0xFFFF };
+
+		static NMJ_FORCEINLINE __m128i Load(const void *in)
+		{
+			return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)in), _mm_setzero_si128());
+		}
+
+		static NMJ_FORCEINLINE void Store(void *out, __m128i raw)
+		{
+			// Sign extend the 16bit values, so that the saturating pack keeps them intact.
+			raw = _mm_srai_epi32(_mm_slli_epi32(raw, 16), 16);
+			_mm_storel_epi64((__m128i *)out, _mm_packs_epi32(raw, raw));
+		}
+
+		static NMJ_FORCEINLINE __m128i GetDepth(__m128i raw)
+		{
+			return raw;
+		}
+
+		static NMJ_FORCEINLINE __m128i SetDepth(__m128i raw, __m128i depth, __m128i mask)
+		{
+			return _mm_or_si128(_mm_andnot_si128(mask, raw), _mm_and_si128(mask, depth));
+		}
+
+		static NMJ_FORCEINLINE __m128i Encode(__m128 z)
+		{
+			__m128i depth = _mm_cvtps_epi32(_mm_mul_ps(z, _mm_set1_ps(float(MaxValue))));
+			return MinEpi32(MaxEpi32(depth, _mm_setzero_si128()), _mm_set1_epi32(MaxValue));
+		}
+
+		static NMJ_FORCEINLINE S32 Encode(float z)
+		{
+			return Min(Max(_mm_cvtss_si32(_mm_mul_ss(_mm_set_ss(z), _mm_set_ss(float(MaxValue)))), 0), MaxValue);
+		}
+
+		static NMJ_FORCEINLINE __m128i GetClearValue(float depth, U8 stencil)
+		{
+			return _mm_set1_epi16(S16(Encode(depth)));
+		}
+	};
+
+	template <>
+	struct DepthBufferFormat<RasterizerDepthFormatD32F> : DepthLayout<4>
+	{
+		static NMJ_FORCEINLINE __m128i Load(const void *in)
+		{
+			return _mm_load_si128((const __m128i *)in);
+		}
+
+		static NMJ_FORCEINLINE void Store(void *out, __m128i raw)
+		{
+			_mm_store_si128((__m128i *)out, raw);
+		}
+
+		static NMJ_FORCEINLINE __m128i GetDepth(__m128i raw)
+		{
+			return raw;
+		}
+
+		static NMJ_FORCEINLINE __m128i SetDepth(__m128i raw, __m128i depth, __m128i mask)
+		{
+			return _mm_or_si128(_mm_andnot_si128(mask, raw), _mm_and_si128(mask, depth));
+		}
+
+		static NMJ_FORCEINLINE __m128i Encode(__m128 z)
+		{
+			return _mm_castps_si128(_mm_max_ps(z, _mm_setzero_ps()));
+		}
+
+		static NMJ_FORCEINLINE S32 Encode(float z)
+		{
+			return _mm_cvtsi128_si32(_mm_castps_si128(_mm_max_ss(_mm_set_ss(z), _mm_setzero_ps())));
+		}
+
+		static NMJ_FORCEINLINE __m128i GetClearValue(float depth, U8 stencil)
+		{
+			return _mm_set1_epi32(Encode(depth));
+		}
+	};
+
+	// Get mask of pixels, which pass the depth test.
+	template <U32 DepthCompare>
+	NMJ_FORCEINLINE __m128i GetDepthTestMask(__m128i old_z, __m128i new_z)
+	{
+		switch (DepthCompare)
+		{
+			case RasterizerCompareLess:      return _mm_cmpgt_epi32(old_z, new_z);
+			case RasterizerCompareLessEqual: return _mm_xor_si128(_mm_cmpgt_epi32(new_z, old_z), _mm_set1_epi32(-1));
+			case RasterizerCompareGreater:   return _mm_cmpgt_epi32(new_z, old_z);
+			case RasterizerCompareEqual:     return _mm_cmpeq_epi32(old_z, new_z);
+			default:                       return _mm_set1_epi32(-1);
+		}
+	}
+
+	// Get size of a depth buffer tile in bytes.
+	static U32 GetDepthTileBytes(U32 depth_format)
+	{
+		switch (depth_format)
+		{
+			case RasterizerDepthFormatD16:  return DepthBufferFormat<RasterizerDepthFormatD16>::TileBytes;
+			case RasterizerDepthFormatD32F: return DepthBufferFormat<RasterizerDepthFormatD32F>::TileBytes;
+			default:                        return DepthBufferFormat<RasterizerDepthFormatD24S8>::TileBytes;
+		}
+	}
+
+	// Select values from a where mask is set and otherwise from b.
+	NMJ_FORCEINLINE __m128i Select(__m128i mask, __m128i a, __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	// Get stencil values from the raw RasterizerDepthFormatD24S8 values.
+	NMJ_FORCEINLINE __m128i GetStencil(__m128i raw)
+	{
+		return _mm_srli_epi32(raw, 24);
+	}
+
+	// Replace stencil of the masked pixels of the raw RasterizerDepthFormatD24S8 values.
+	NMJ_FORCEINLINE __m128i SetStencil(__m128i raw, __m128i stencil, __m128i mask)
+	{
+		return Select(mask, _mm_or_si128(_mm_and_si128(raw, _mm_set1_epi32(0x00FFFFFF)), _mm_slli_epi32(stencil, 24)), raw);
+	}
+
+	// Get mask of pixels, which pass the stencil test.
+	NMJ_FORCEINLINE __m128i GetStencilTestMask(const DrawState &draw, __m128i stencil)
+	{
+		__m128i value = _mm_and_si128(stencil, draw.stencil_read_mask);
+		__m128i less = _mm_and_si128(_mm_cmpgt_epi32(value, draw.stencil_ref), draw.stencil_test_less);
+		__m128i equal = _mm_and_si128(_mm_cmpeq_epi32(value, draw.stencil_ref), draw.stencil_test_equal);
+		__m128i greater = _mm_and_si128(_mm_cmpgt_epi32(draw.stencil_ref, value), draw.stencil_test_greater);
+		return _mm_or_si128(_mm_or_si128(less, equal), greater);
+	}
+
+	// Apply the stencil operations selected by the stencil and depth test results.
+	NMJ_FORCEINLINE __m128i ApplyStencilOp(const DrawState &draw, __m128i stencil, __m128i stencil_pass, __m128i depth_pass)
+	{
+		__m128i depth_fail = _mm_andnot_si128(depth_pass, stencil_pass);
+		__m128i pass = _mm_and_si128(depth_pass, stencil_pass);
+
+		__m128i op_and = Select(pass, draw.stencil_op_and[2], Select(depth_fail, draw.stencil_op_and[1], draw.stencil_op_and[0]));
+		__m128i op_xor = Select(pass, draw.stencil_op_xor[2], Select(depth_fail, draw.stencil_op_xor[1], draw.stencil_op_xor[0]));
+		__m128i op_add = Select(pass, draw.stencil_op_add[2], Select(depth_fail, draw.stencil_op_add[1], draw.stencil_op_add[0]));
+
+		__m128i result = _mm_add_epi32(_mm_xor_si128(_mm_and_si128(stencil, op_and), op_xor), op_add);
+		result = MinEpi32(MaxEpi32(result, _mm_setzero_si128()), _mm_set1_epi32(0xFF));
+		return Select(draw.stencil_write_mask, result, stencil);
+	}
+
+	// Number of set bits in 4bit mask.
+	static const U8 BitCount4[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+	// Count the pixels of a block that are enabled in the mask.
+	NMJ_FORCEINLINE U32 CountMaskPixels(__m128i mask)
+	{
+		return BitCount4[_mm_movemask_ps(_mm_castsi128_ps(mask))];
+	}
+
+	// Tile information shared by all the tile rasterizers.
+	struct TileSetup
+	{
+		// Tile rectangle.
+		S32 min_x, min_y;
+		S32 max_x, max_y;
+
+		// Vertex transform matrix to fixed point screen coordinates.
+		__m128 transform_matrix[4];
+	};
+
+	// Triangle information shared by all the tile rasterizers.
+	struct TriangleSetup
+	{
+		// Vertex indices and transformed vertices.
+		U16 index[3];
+		__declspec(align(16)) float v[3][4];
+
+		// Barycentric integer coordinates for 2x2 block stepping.
+		__m128i bcoord_row[3], bcoord_xstep[3], bcoord_ystep[3];
+
+		// Normalized barycentric coordinates of vertices 1 and 2 as floating point.
+		__m128 bcoordf_row[2], bcoordf_xstep[2], bcoordf_ystep[2];
+
+		// Block offset and block count within the tile.
+		U32 block_offset_x, block_offset_y;
+		U32 xcount, ycount;
+	};
+
+	NMJ_FORCEINLINE void SetupTile(
+		TileSetup &tile,
 		U32 tile_x, U32 tile_y,
 		U32 screen_width, U32 screen_height,
-		void *color_buffer, void *depth_buffer,
 		const RasterizerInput &input)
 	{
 		// Screen coordinates.
@@ -89,251 +381,1293 @@ namespace nmj
 		S32 sy = tile_y * TileSizeY;
 
 		// Tile rectangle.
-		S32 tile_min_x = sx - scx;
-		S32 tile_min_y = sy - scy;
-		S32 tile_max_x = Min((sx + TileSizeX) - scx, scx - 1);
-		S32 tile_max_y = Min((sy + TileSizeY) - scy, scx - 1);
+		tile.min_x = sx - scx;
+		tile.min_y = sy - scy;
+		tile.max_x = Min((sx + TileSizeX) - scx, scx - 1);
+		tile.max_y = Min((sy + TileSizeY) - scy, scx - 1);
 
 		// Vertex transform matrix
-		__m128 transform_matrix[4] =
-		{
-			_mm_loadu_ps(input.transform[0]),
-			_mm_loadu_ps(input.transform[1]),
-			_mm_loadu_ps(input.transform[2]),
-			_mm_loadu_ps(input.transform[3])
-		};
+		tile.transform_matrix[0] = _mm_loadu_ps(input.transform[0]);
+		tile.transform_matrix[1] = _mm_loadu_ps(input.transform[1]);
+		tile.transform_matrix[2] = _mm_loadu_ps(input.transform[2]);
+		tile.transform_matrix[3] = _mm_loadu_ps(input.transform[3]);
 
 		// Invert vertex y and scale x and y to screen coordinates.
 		{
 			float xscale = float(scx << PixelFracBits);
 			float yscale = float(scy << PixelFracBits);
 
-			__m128 scale = _mm_set_ps(1.0f, 1.0f, yscale, xscale);
-			__m128 neg_scale = _mm_set_ps(-1.0f, -1.0f, -yscale, -xscale);
+			__m128 scale = _mm_set_ps(1.0f, 1.0f, yscale, xscale);
+			__m128 neg_scale = _mm_set_ps(-1.0f, -1.0f, -yscale, -xscale);
+
+			tile.transform_matrix[0] = _mm_mul_ps(tile.transform_matrix[0], scale);
+			tile.transform_matrix[1] = _mm_mul_ps(tile.transform_matrix[1], neg_scale);
+			tile.transform_matrix[2] = _mm_mul_ps(tile.transform_matrix[2], scale);
+			tile.transform_matrix[3] = _mm_mul_ps(tile.transform_matrix[3], scale);
+		}
+	}
+
+	// Transform the triangle and setup the barycentric stepping over the tile.
+	// Returns false, when the triangle doesn't need to be rasterized for the tile.
+	NMJ_FORCEINLINE bool SetupTriangle(TriangleSetup &tri, const TileSetup &tile, const float *vertices, const U16 *indices)
+	{
+		float (&v)[3][4] = tri.v;
+
+		// Fetch triangle vertex information
+		{
+			const U16 i0 = indices[0];
+			const U16 i1 = indices[1];
+			const U16 i2 = indices[2];
+
+			tri.index[0] = i0;
+			tri.index[1] = i1;
+			tri.index[2] = i2;
+
+			v[0][0] = vertices[i0 * 3 + 0];
+			v[0][1] = vertices[i0 * 3 + 1];
+			v[0][2] = vertices[i0 * 3 + 2];
+			v[1][0] = vertices[i1 * 3 + 0];
+			v[1][1] = vertices[i1 * 3 + 1];
+			v[1][2] = vertices[i1 * 3 + 2];
+			v[2][0] = vertices[i2 * 3 + 0];
+			v[2][1] = vertices[i2 * 3 + 1];
+			v[2][2] = vertices[i2 * 3 + 2];
+		}
+
+		// Transform vertices
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			__m128 result;
+			result = _mm_mul_ps(tile.transform_matrix[0], _mm_set1_ps(v[i][0]));
+			result = _mm_add_ps(result, _mm_mul_ps(tile.transform_matrix[1], _mm_set1_ps(v[i][1])));
+			result = _mm_add_ps(result, _mm_mul_ps(tile.transform_matrix[2], _mm_set1_ps(v[i][2])));
+			result = _mm_add_ps(result, tile.transform_matrix[3]);
+			_mm_store_ps(v[i], result);
+		}
+
+		// Hack rejection for planes, that cross near plane
+		if (v[0][2] < 0.0f || v[1][2] < 0.0f || v[2][2] < 0.0f)
+			return false;
+
+		// Convert to clip space coordinates to fixed point screen space coordinates.
+		S32 coord[3][2];
+		coord[0][0] = S32(v[0][0] / v[0][3]);
+		coord[0][1] = S32(v[0][1] / v[0][3]);
+		coord[1][0] = S32(v[1][0] / v[1][3]);
+		coord[1][1] = S32(v[1][1] / v[1][3]);
+		coord[2][0] = S32(v[2][0] / v[2][3]);
+		coord[2][1] = S32(v[2][1] / v[2][3]);
+
+		// Some common constants for the barycentric calculations.
+		const S32 coord21x = coord[2][0] - coord[1][0];
+		const S32 coord21y = coord[2][1] - coord[1][1];
+		const S32 coord02x = coord[0][0] - coord[2][0];
+		const S32 coord02y = coord[0][1] - coord[2][1];
+
+		// Triangle area * 2
+		const S32 triarea_x2 = -((coord02x * coord21y) >> PixelFracBits) + ((coord02y * coord21x) >> PixelFracBits);
+		if (triarea_x2 < 0)
+			return false;
+
+		// Calculate bounds
+		S32 bounds[2][2];
+		bounds[0][0] = (Min(Min(coord[0][0], coord[1][0]), coord[2][0]) + (PixelFracUnit - 1)) >> PixelFracBits;
+		bounds[0][1] = (Min(Min(coord[0][1], coord[1][1]), coord[2][1]) + (PixelFracUnit - 1)) >> PixelFracBits;
+		bounds[1][0] = (Max(Max(coord[0][0], coord[1][0]), coord[2][0]) + (PixelFracUnit - 1)) >> PixelFracBits;
+		bounds[1][1] = (Max(Max(coord[0][1], coord[1][1]), coord[2][1]) + (PixelFracUnit - 1)) >> PixelFracBits;
+
+		// Clip off-tile triangles.
+		// NOTE: If the binning process would be accurate enough, we could just ignore this.
+		if (bounds[0][0] > tile.max_x || bounds[0][1] > tile.max_y)
+			return false;
+		if (bounds[1][0] < tile.min_x || bounds[1][1] < tile.min_y)
+			return false;
+
+		// Make sure that the bounds are block aligned
+		bounds[0][0] = Max(Min(bounds[0][0], tile.max_x), tile.min_x) & ~(BlockSizeX - 1);
+		bounds[0][1] = Max(Min(bounds[0][1], tile.max_y), tile.min_y) & ~(BlockSizeY - 1);
+		bounds[1][0] = (Max(Min(bounds[1][0] + 1, tile.max_x), tile.min_x) + (BlockSizeX - 1)) & ~(BlockSizeX - 1);
+		bounds[1][1] = (Max(Min(bounds[1][1] + 1, tile.max_y), tile.min_y) + (BlockSizeY - 1)) & ~(BlockSizeY - 1);
+
+		// Barycentric integer coordinates
+		__m128i (&bcoord_row)[3] = tri.bcoord_row;
+		__m128i (&bcoord_xstep)[3] = tri.bcoord_xstep;
+		__m128i (&bcoord_ystep)[3] = tri.bcoord_ystep;
+		{
+			__m128i offsetx = _mm_add_epi32(_mm_set1_epi32(bounds[0][0]), _mm_set_epi32(1, 0, 1, 0));
+			__m128i offsety = _mm_add_epi32(_mm_set1_epi32(bounds[0][1]), _mm_set_epi32(1, 1, 0, 0));
+
+			// 1x1 block steps
+			bcoord_xstep[0] = _mm_set1_epi32(-coord21y);
+			bcoord_xstep[1] = _mm_set1_epi32(-coord02y);
+			bcoord_xstep[2] = _mm_set1_epi32(coord[0][1] - coord[1][1]);
+			bcoord_ystep[0] = _mm_set1_epi32(coord21x);
+			bcoord_ystep[1] = _mm_set1_epi32(coord02x);
+			bcoord_ystep[2] = _mm_set1_epi32(coord[1][0] - coord[0][0]);
+
+			// Triangle start position
+			bcoord_row[0] = _mm_set1_epi32(((coord21x * -coord[1][1]) >> PixelFracBits) - ((coord21y * -coord[1][0]) >> PixelFracBits));
+			bcoord_row[0] = _mm_add_epi32(bcoord_row[0], MulEpi32(offsetx, bcoord_xstep[0]));
+			bcoord_row[0] = _mm_add_epi32(bcoord_row[0], MulEpi32(offsety, bcoord_ystep[0]));
+			bcoord_row[0] = _mm_sub_epi32(bcoord_row[0], _mm_srai_epi32(bcoord_xstep[0], 1));
+			bcoord_row[0] = _mm_sub_epi32(bcoord_row[0], _mm_srai_epi32(bcoord_ystep[0], 1));
+			bcoord_row[1] = _mm_set1_epi32(((coord02x * -coord[2][1]) >> PixelFracBits) - ((coord02y * -coord[2][0]) >> PixelFracBits));
+			bcoord_row[1] = _mm_add_epi32(bcoord_row[1], MulEpi32(offsetx, bcoord_xstep[1]));
+			bcoord_row[1] = _mm_add_epi32(bcoord_row[1], MulEpi32(offsety, bcoord_ystep[1]));
+			bcoord_row[1] = _mm_sub_epi32(bcoord_row[1], _mm_srai_epi32(bcoord_xstep[1], 1));
+			bcoord_row[1] = _mm_sub_epi32(bcoord_row[1], _mm_srai_epi32(bcoord_ystep[1], 1));
+
+			// Change stepping to 2x2 blocks
+			bcoord_xstep[0] = _mm_slli_epi32(bcoord_xstep[0], 1);
+			bcoord_xstep[1] = _mm_slli_epi32(bcoord_xstep[1], 1);
+			bcoord_xstep[2] = _mm_slli_epi32(bcoord_xstep[2], 1);
+			bcoord_ystep[0] = _mm_slli_epi32(bcoord_ystep[0], 1);
+			bcoord_ystep[1] = _mm_slli_epi32(bcoord_ystep[1], 1);
+			bcoord_ystep[2] = _mm_slli_epi32(bcoord_ystep[2], 1);
+
+			bcoord_row[2] = _mm_sub_epi32(_mm_sub_epi32(_mm_set1_epi32(triarea_x2), bcoord_row[0]), bcoord_row[1]);
+		}
+
+		// Normalized barycentric coordinates as floating point.
+		{
+			__m128 inv_triarea_x2f = _mm_rcp_ps(_mm_cvtepi32_ps(_mm_set1_epi32(triarea_x2)));
+			tri.bcoordf_row[0] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_row[1]), inv_triarea_x2f);
+			tri.bcoordf_row[1] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_row[2]), inv_triarea_x2f);
+			tri.bcoordf_xstep[0] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_xstep[1]), inv_triarea_x2f);
+			tri.bcoordf_xstep[1] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_xstep[2]), inv_triarea_x2f);
+			tri.bcoordf_ystep[0] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_ystep[1]), inv_triarea_x2f);
+			tri.bcoordf_ystep[1] = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_ystep[2]), inv_triarea_x2f);
+		}
+
+		// Output block range
+		{
+			S32 tile_begin_x = (bounds[0][0] - tile.min_x) / BlockSizeX;
+			S32 tile_begin_y = (bounds[0][1] - tile.min_y) / BlockSizeY;
+			S32 tile_end_x = (bounds[1][0] - tile.min_x) / BlockSizeX;
+			S32 tile_end_y = (bounds[1][1] - tile.min_y) / BlockSizeY;
+
+			tri.block_offset_x = tile_begin_x;
+			tri.block_offset_y = tile_begin_y;
+			tri.xcount = tile_end_x - tile_begin_x;
+			tri.ycount = tile_end_y - tile_begin_y;
+		}
+
+		return true;
+	}
+
+	// Setup stepping for a screen-space linear attribute from its per vertex values.
+	NMJ_FORCEINLINE void SetupLinearAttribute(const TriangleSetup &tri, __m128 a0, __m128 a1, __m128 a2, __m128 &row, __m128 &xstep, __m128 &ystep)
+	{
+		__m128 a10 = _mm_sub_ps(a1, a0);
+		__m128 a20 = _mm_sub_ps(a2, a0);
+		row = _mm_add_ps(a0, _mm_add_ps(_mm_mul_ps(a10, tri.bcoordf_row[0]), _mm_mul_ps(a20, tri.bcoordf_row[1])));
+		xstep = _mm_add_ps(_mm_mul_ps(a10, tri.bcoordf_xstep[0]), _mm_mul_ps(a20, tri.bcoordf_xstep[1]));
+		ystep = _mm_add_ps(_mm_mul_ps(a10, tri.bcoordf_ystep[0]), _mm_mul_ps(a20, tri.bcoordf_ystep[1]));
+	}
+
+	// Mip levels of the largest texture, with 16bit resolution.
+	enum { MaxTextureLevels = 16 };
+
+	// Texture mip level constants for sampling.
+	struct TextureLevel
+	{
+		const char *texels;
+		__m128 size_x, size_y;
+		__m128i mask_x, mask_y;
+
+		// Texel addressing, where linear layout is a single row per tile and
+		// compressed formats have a block per tile.
+		__m128i tile_mask_x, tile_mask_y;
+		__m128i tile_shift_x, tile_shift_y;
+		__m128i tile_row_shift, tile_texel_shift;
+	};
+
+	// Texture constants for sampling, prepared once per tile.
+	struct TextureSetup
+	{
+		const char *texels;
+		U32 width_shift, height_shift;
+		U32 mip_count;
+		U32 mip_filter;
+		U32 layout;
+		U32 format;
+		U32 level_offset[MaxTextureLevels];
+		TextureLevel base;
+	};
+
+	// Decoded blocks of compressed textures, so that the neighbouring texel fetches
+	// don't decode the same block again. Entry is selected by the block position, so
+	// that the 2x2 blocks touched by bilinear filtering never evict each other.
+	struct TextureBlockCache
+	{
+		enum { EntryCount = 8 };
+
+		const char *tag[EntryCount];
+		__declspec(align(16)) U32 texels[EntryCount][16];
+	};
+
+	static void InitializeTextureBlockCache(TextureBlockCache &self)
+	{
+		for (U32 i = 0; i < TextureBlockCache::EntryCount; ++i)
+			self.tag[i] = NULL;
+	}
+
+	// Base 2 logarithm of power of two value.
+	static U32 GetLog2(U32 value)
+	{
+		NMJ_ASSERT(value && (value & (value - 1)) == 0);
+
+		U32 result = 0;
+		while ((1U << result) < value)
+			++result;
+		return result;
+	}
+
+	// Number of mip levels in full mip chain.
+	static U32 GetTextureLevelCount(U32 width, U32 height)
+	{
+		return U32(Max(S32(GetLog2(width)), S32(GetLog2(height)))) + 1;
+	}
+
+	// Resolution of the mip level.
+	static U32 GetTextureLevelSize(U32 size, U32 level)
+	{
+		return Max(S32(size >> level), 1);
+	}
+
+	// Tile size of RasterizerTextureLayoutTiled and block size of the compressed formats.
+	enum { TextureTileShift = 2 };
+
+	// Size of compressed block or zero for uncompressed format.
+	static U32 GetTextureBlockBytes(U32 format)
+	{
+		switch (format)
+		{
+			case RasterizerTextureFormatBC1: return 8;
+			case RasterizerTextureFormatBC3: return 16;
+			default:
+				NMJ_ASSERT(format == RasterizerTextureFormatRGBA8);
+				return 0;
+		}
+	}
+
+	// Size of the mip level in bytes. Compressed levels are padded to full blocks.
+	static U32 GetTextureLevelBytes(U32 format, U32 width, U32 height, U32 level)
+	{
+		const U32 block_bytes = GetTextureBlockBytes(format);
+		if (block_bytes == 0)
+			return GetTextureLevelSize(width, level) * GetTextureLevelSize(height, level) * sizeof(U32);
+
+		const U32 block_size = 1 << TextureTileShift;
+		const U32 blocks_x = DivWithRoundUp<U32>(GetTextureLevelSize(width, level), block_size);
+		const U32 blocks_y = DivWithRoundUp<U32>(GetTextureLevelSize(height, level), block_size);
+		return blocks_x * blocks_y * block_bytes;
+	}
+
+	// Tile size of the mip level in the texture layout.
+	static void GetTextureTileShift(U32 layout, U32 width_shift, U32 height_shift, U32 &tile_shift_x, U32 &tile_shift_y)
+	{
+		if (layout == RasterizerTextureLayoutTiled)
+		{
+			tile_shift_x = U32(Min(S32(width_shift), TextureTileShift));
+			tile_shift_y = U32(Min(S32(height_shift), TextureTileShift));
+		}
+		else
+		{
+			NMJ_ASSERT(layout == RasterizerTextureLayoutLinear);
+			tile_shift_x = width_shift;
+			tile_shift_y = 0;
+		}
+	}
+
+	static void SetupTextureLevel(TextureLevel &self, const TextureSetup &texture, U32 level)
+	{
+		const U32 width_shift = U32(Max(S32(texture.width_shift) - S32(level), 0));
+		const U32 height_shift = U32(Max(S32(texture.height_shift) - S32(level), 0));
+
+		U32 tile_shift_x, tile_shift_y;
+		if (texture.format == RasterizerTextureFormatRGBA8)
+		{
+			GetTextureTileShift(texture.layout, width_shift, height_shift, tile_shift_x, tile_shift_y);
+		}
+		else
+		{
+			tile_shift_x = TextureTileShift;
+			tile_shift_y = TextureTileShift;
+		}
+
+		self.texels = texture.texels + texture.level_offset[level];
+		self.size_x = _mm_set1_ps(float(1 << width_shift));
+		self.size_y = _mm_set1_ps(float(1 << height_shift));
+		self.mask_x = _mm_set1_epi32((1 << width_shift) - 1);
+		self.mask_y = _mm_set1_epi32((1 << height_shift) - 1);
+
+		self.tile_mask_x = _mm_set1_epi32((1 << tile_shift_x) - 1);
+		self.tile_mask_y = _mm_set1_epi32((1 << tile_shift_y) - 1);
+		self.tile_shift_x = _mm_cvtsi32_si128(tile_shift_x);
+		self.tile_shift_y = _mm_cvtsi32_si128(tile_shift_y);
+		self.tile_row_shift = _mm_cvtsi32_si128(Max(S32(width_shift) - S32(tile_shift_x), 0));
+		self.tile_texel_shift = _mm_cvtsi32_si128(tile_shift_x + tile_shift_y);
+	}
+
+	static void SetupTexture(TextureSetup &self, const RasterizerTexture &texture, const RasterizerSampler &sampler)
+	{
+		self.texels = (const char *)texture.texels;
+		self.width_shift = GetLog2(texture.width);
+		self.height_shift = GetLog2(texture.height);
+		self.mip_count = U32(Min(Max(texture.mip_count, 1), S32(GetTextureLevelCount(texture.width, texture.height))));
+		self.mip_filter = sampler.mip_filter;
+		self.layout = texture.layout;
+		self.format = texture.format;
+
+		U32 offset = 0;
+		for (U32 level = 0; level < self.mip_count; ++level)
+		{
+			self.level_offset[level] = offset;
+			offset += GetTextureLevelBytes(texture.format, texture.width, texture.height, level);
+		}
+
+		SetupTextureLevel(self.base, self, 0);
+	}
+
+	// Round towards negative infinity.
+	NMJ_FORCEINLINE __m128i FloorEpi32(__m128 x)
+	{
+		__m128i result = _mm_cvttps_epi32(x);
+		return _mm_add_epi32(result, _mm_castps_si128(_mm_cmplt_ps(x, _mm_cvtepi32_ps(result))));
+	}
+
+	// Expand RGB565 color to RGBA8 with opaque alpha.
+	NMJ_FORCEINLINE U32 ExpandRGB565(U32 color)
+	{
+		const U32 r = (color >> 11) & 0x1F;
+		const U32 g = (color >> 5) & 0x3F;
+		const U32 b = color & 0x1F;
+		return ((r << 3) | (r >> 2)) | (((g << 2) | (g >> 4)) << 8) | (((b << 3) | (b >> 2)) << 16) | 0xFF000000;
+	}
+
+	// Weighted average of RGBA8 colors, (a * weight_a + b * weight_b) / divisor per channel.
+	NMJ_FORCEINLINE U32 BlendRGBA8(U32 a, U32 b, U32 weight_a, U32 weight_b, U32 divisor)
+	{
+		U32 result = 0;
+		for (U32 shift = 0; shift < 32; shift += 8)
+			result |= ((((a >> shift) & 0xFF) * weight_a + ((b >> shift) & 0xFF) * weight_b) / divisor) << shift;
+		return result;
+	}
+
+	// Decode BC1 color block, in 3 color mode with transparent black, when allowed.
+	static void DecodeColorBlock(U32 (&out)[16], const U8 *block, bool allow_transparent)
+	{
+		const U32 color0 = block[0] | (block[1] << 8);
+		const U32 color1 = block[2] | (block[3] << 8);
+		const U32 indices = block[4] | (block[5] << 8) | (block[6] << 16) | (U32(block[7]) << 24);
+
+		U32 palette[4];
+		palette[0] = ExpandRGB565(color0);
+		palette[1] = ExpandRGB565(color1);
+		if (color0 > color1 || !allow_transparent)
+		{
+			palette[2] = BlendRGBA8(palette[0], palette[1], 2, 1, 3);
+			palette[3] = BlendRGBA8(palette[0], palette[1], 1, 2, 3);
+		}
+		else
+		{
+			palette[2] = BlendRGBA8(palette[0], palette[1], 1, 1, 2);
+			palette[3] = 0;
+		}
+
+		for (U32 i = 0; i < 16; ++i)
+			out[i] = palette[(indices >> (i * 2)) & 3];
+	}
+
+	// Decode BC3 alpha block to the alpha channel of the decoded colors.
+	static void DecodeAlphaBlock(U32 (&out)[16], const U8 *block)
+	{
+		const U32 alpha0 = block[0];
+		const U32 alpha1 = block[1];
+
+		U32 palette[8];
+		palette[0] = alpha0;
+		palette[1] = alpha1;
+		if (alpha0 > alpha1)
+		{
+			for (U32 i = 1; i < 7; ++i)
+				palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+		}
+		else
+		{
+			for (U32 i = 1; i < 5; ++i)
+				palette[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+
+		// 3bit indices of 8 texels in each 24bit half.
+		for (U32 half = 0; half < 2; ++half)
+		{
+			const U8 *bytes = block + 2 + half * 3;
+			const U32 indices = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+			for (U32 i = 0; i < 8; ++i)
+			{
+				U32 &texel = out[half * 8 + i];
+				texel = (texel & 0x00FFFFFF) | (palette[(indices >> (i * 3)) & 7] << 24);
+			}
+		}
+	}
+
+	// Texture formats for fetching texels.
+	template <U32 Format>
+	struct TextureFormat;
+
+	template <>
+	struct TextureFormat<RasterizerTextureFormatRGBA8>
+	{
+		// Fetch 4 texels from wrapped texel coordinates.
+		static NMJ_FORCEINLINE __m128i Fetch(const TextureLevel &texture, TextureBlockCache &cache, __m128i x, __m128i y)
+		{
+			// Tile index and texel index in the tile.
+			__m128i tile = _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(y, texture.tile_shift_y), texture.tile_row_shift), _mm_srl_epi32(x, texture.tile_shift_x));
+			__m128i texel = _mm_or_si128(_mm_sll_epi32(_mm_and_si128(y, texture.tile_mask_y), texture.tile_shift_x), _mm_and_si128(x, texture.tile_mask_x));
+			__m128i index = _mm_or_si128(_mm_sll_epi32(tile, texture.tile_texel_shift), texel);
+
+			const U32 *texels = (const U32 *)texture.texels;
+			return _mm_setr_epi32(
+				texels[_mm_cvtsi128_si32(index)],
+				texels[_mm_cvtsi128_si32(_mm_shuffle_epi32(index, _MM_SHUFFLE(1, 1, 1, 1)))],
+				texels[_mm_cvtsi128_si32(_mm_shuffle_epi32(index, _MM_SHUFFLE(2, 2, 2, 2)))],
+				texels[_mm_cvtsi128_si32(_mm_shuffle_epi32(index, _MM_SHUFFLE(3, 3, 3, 3)))]);
+		}
+	};
+
+	// Fetch 4 texels of compressed texture through the decoded block cache.
+	template <typename Format>
+	NMJ_FORCEINLINE __m128i FetchCompressedTexels(const TextureLevel &texture, TextureBlockCache &cache, __m128i x, __m128i y)
+	{
+		const __m128i three = _mm_set1_epi32(3);
+
+		// Block offset, texel index in the block and cache entry from the block position.
+		__m128i block_x = _mm_srli_epi32(x, TextureTileShift);
+		__m128i block_y = _mm_srli_epi32(y, TextureTileShift);
+		__m128i offset = _mm_slli_epi32(_mm_add_epi32(_mm_sll_epi32(block_y, texture.tile_row_shift), block_x), Format::BlockShift);
+		__m128i texel = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(y, three), TextureTileShift), _mm_and_si128(x, three));
+		__m128i entry = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(block_y, _mm_set1_epi32(1)), 2), _mm_and_si128(block_x, three));
+
+		__declspec(align(16)) U32 offsets[4];
+		__declspec(align(16)) U32 texels[4];
+		__declspec(align(16)) U32 entries[4];
+		_mm_store_si128((__m128i *)offsets, offset);
+		_mm_store_si128((__m128i *)texels, texel);
+		_mm_store_si128((__m128i *)entries, entry);
+
+		__declspec(align(16)) U32 result[4];
+		for (U32 i = 0; i < 4; ++i)
+		{
+			const char *block = texture.texels + offsets[i];
+			const U32 index = entries[i];
+			if (cache.tag[index] != block)
+			{
+				Format::DecodeBlock(cache.texels[index], (const U8 *)block);
+				cache.tag[index] = block;
+			}
+			result[i] = cache.texels[index][texels[i]];
+		}
+		return _mm_load_si128((const __m128i *)result);
+	}
+
+	template <>
+	struct TextureFormat<RasterizerTextureFormatBC1>
+	{
+		enum { BlockShift = 3 };
+
+		static void DecodeBlock(U32 (&out)[16], const U8 *block)
+		{
+			DecodeColorBlock(out, block, true);
+		}
+
+		static NMJ_FORCEINLINE __m128i Fetch(const TextureLevel &texture, TextureBlockCache &cache, __m128i x, __m128i y)
+		{
+			return FetchCompressedTexels<TextureFormat>(texture, cache, x, y);
+		}
+	};
+
+	template <>
+	struct TextureFormat<RasterizerTextureFormatBC3>
+	{
+		enum { BlockShift = 4 };
+
+		static void DecodeBlock(U32 (&out)[16], const U8 *block)
+		{
+			DecodeColorBlock(out, block + 8, false);
+			DecodeAlphaBlock(out, block);
+		}
+
+		static NMJ_FORCEINLINE __m128i Fetch(const TextureLevel &texture, TextureBlockCache &cache, __m128i x, __m128i y)
+		{
+			return FetchCompressedTexels<TextureFormat>(texture, cache, x, y);
+		}
+	};
+
+	// Interpolate 16bit channels with 8bit weights.
+	NMJ_FORCEINLINE __m128i LerpEpi16(__m128i a, __m128i b, __m128i weight)
+	{
+		// a * (256 - weight) + b * weight fits in unsigned 16bit.
+		__m128i result = _mm_mullo_epi16(a, _mm_sub_epi16(_mm_set1_epi16(256), weight));
+		result = _mm_add_epi16(result, _mm_mullo_epi16(b, weight));
+		return _mm_srli_epi16(result, 8);
+	}
+
+	// Bilinear interpolation of 4 texels per pixel for 4 pixels.
+	NMJ_FORCEINLINE __m128i FilterBilinear(__m128i t00, __m128i t10, __m128i t01, __m128i t11, __m128i weight_x, __m128i weight_y)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		// Broadcast the per pixel weights to the 16bit channels of pixels 0-1 and 2-3.
+		__m128i wx = _mm_packs_epi32(weight_x, weight_x);
+		__m128i wy = _mm_packs_epi32(weight_y, weight_y);
+		wx = _mm_unpacklo_epi16(wx, wx);
+		wy = _mm_unpacklo_epi16(wy, wy);
+		__m128i wx_lo = _mm_unpacklo_epi32(wx, wx);
+		__m128i wx_hi = _mm_unpackhi_epi32(wx, wx);
+		__m128i wy_lo = _mm_unpacklo_epi32(wy, wy);
+		__m128i wy_hi = _mm_unpackhi_epi32(wy, wy);
+
+		__m128i lo = LerpEpi16(
+			LerpEpi16(_mm_unpacklo_epi8(t00, zero), _mm_unpacklo_epi8(t10, zero), wx_lo),
+			LerpEpi16(_mm_unpacklo_epi8(t01, zero), _mm_unpacklo_epi8(t11, zero), wx_lo),
+			wy_lo);
+		__m128i hi = LerpEpi16(
+			LerpEpi16(_mm_unpackhi_epi8(t00, zero), _mm_unpackhi_epi8(t10, zero), wx_hi),
+			LerpEpi16(_mm_unpackhi_epi8(t01, zero), _mm_unpackhi_epi8(t11, zero), wx_hi),
+			wy_hi);
+		return _mm_packus_epi16(lo, hi);
+	}
+
+	// Texture addressing modes for texel coordinates.
+	template <U32 AddressMode>
+	struct TextureAddress;
+
+	template <>
+	struct TextureAddress<RasterizerAddressWrap>
+	{
+		// Works for negative coordinates too with power of two sizes.
+		static NMJ_FORCEINLINE __m128i Apply(__m128i x, __m128i mask)
+		{
+			return _mm_and_si128(x, mask);
+		}
+	};
+
+	template <>
+	struct TextureAddress<RasterizerAddressClamp>
+	{
+		static NMJ_FORCEINLINE __m128i Apply(__m128i x, __m128i mask)
+		{
+			return MinEpi32(MaxEpi32(x, _mm_setzero_si128()), mask);
+		}
+	};
+
+	template <>
+	struct TextureAddress<RasterizerAddressMirror>
+	{
+		static NMJ_FORCEINLINE __m128i Apply(__m128i x, __m128i mask)
+		{
+			// Wrap to twice the size and flip the second half, as size * 2 - 1 - x.
+			__m128i mask2 = _mm_or_si128(_mm_slli_epi32(mask, 1), _mm_set1_epi32(1));
+			x = _mm_and_si128(x, mask2);
+			return _mm_xor_si128(x, _mm_and_si128(_mm_cmpgt_epi32(x, mask), mask2));
+		}
+	};
+
+	// Sampler state for the pipeline variants.
+	template <U32 AddressModeT, U32 FilterT>
+	struct TextureSampler
+	{
+		enum
+		{
+			AddressMode = AddressModeT,
+			Filter = FilterT
+		};
+	};
+
+	// Sample the mip level for 4 pixels.
+	template <U32 Format, typename Sampler>
+	NMJ_FORCEINLINE __m128i SampleLevel(const TextureLevel &texture, TextureBlockCache &cache, __m128 u, __m128 v)
+	{
+		typedef TextureFormat<Format> Texels;
+		typedef TextureAddress<Sampler::AddressMode> Address;
+
+		if (Sampler::Filter == RasterizerFilterNearest)
+		{
+			__m128i x = Address::Apply(FloorEpi32(_mm_mul_ps(u, texture.size_x)), texture.mask_x);
+			__m128i y = Address::Apply(FloorEpi32(_mm_mul_ps(v, texture.size_y)), texture.mask_y);
+			return Texels::Fetch(texture, cache, x, y);
+		}
+
+		// Texel coordinates relative to the texel centers.
+		__m128 x = _mm_sub_ps(_mm_mul_ps(u, texture.size_x), _mm_set1_ps(0.5f));
+		__m128 y = _mm_sub_ps(_mm_mul_ps(v, texture.size_y), _mm_set1_ps(0.5f));
+		__m128i x0 = FloorEpi32(x);
+		__m128i y0 = FloorEpi32(y);
+
+		// 8bit filter weights from the fractions.
+		__m128i weight_x = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(x, _mm_cvtepi32_ps(x0)), _mm_set1_ps(256.0f)));
+		__m128i weight_y = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(y0)), _mm_set1_ps(256.0f)));
+
+		const __m128i one = _mm_set1_epi32(1);
+		__m128i x1 = Address::Apply(_mm_add_epi32(x0, one), texture.mask_x);
+		__m128i y1 = Address::Apply(_mm_add_epi32(y0, one), texture.mask_y);
+		x0 = Address::Apply(x0, texture.mask_x);
+		y0 = Address::Apply(y0, texture.mask_y);
+
+		__m128i t00 = Texels::Fetch(texture, cache, x0, y0);
+		__m128i t10 = Texels::Fetch(texture, cache, x1, y0);
+		__m128i t01 = Texels::Fetch(texture, cache, x0, y1);
+		__m128i t11 = Texels::Fetch(texture, cache, x1, y1);
+		return FilterBilinear(t00, t10, t01, t11, weight_x, weight_y);
+	}
+
+	// Interpolate 8bit color channels with 8bit weight.
+	NMJ_FORCEINLINE __m128i LerpColor(__m128i a, __m128i b, U32 weight)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i w = _mm_set1_epi16(S16(weight));
+
+		__m128i lo = LerpEpi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), w);
+		__m128i hi = LerpEpi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), w);
+		return _mm_packus_epi16(lo, hi);
+	}
+
+	// Approximate base 2 logarithm of positive value, which is exact for powers of two.
+	NMJ_FORCEINLINE float FastLog2(float value)
+	{
+		union { float f; U32 u; } bits;
+		bits.f = value;
+
+		const float exponent = float(S32(bits.u >> 23) - 127);
+		bits.u = (bits.u & 0x007FFFFF) | 0x3F800000;
+		return exponent + (bits.f - 1.0f);
+	}
+
+	// Level of detail of the 2x2 block from the derivatives of the level 0 texel coordinates.
+	NMJ_FORCEINLINE float GetBlockLod(__m128 x, __m128 y)
+	{
+		// Block pixels are (0, 0), (1, 0), (0, 1) and (1, 1), so the derivatives are
+		// [dx/dx, dy/dx, dx/dy, dy/dy] = [x1, y1, x2, y2] - [x0, y0, x0, y0].
+		__m128 lo = _mm_unpacklo_ps(x, y);
+		__m128 hi = _mm_unpackhi_ps(x, y);
+		__m128 d = _mm_sub_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(1, 0, 3, 2)), _mm_movelh_ps(lo, lo));
+
+		// Squared lengths of the screen x and y derivatives and the larger one.
+		d = _mm_mul_ps(d, d);
+		d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1)));
+		d = _mm_max_ss(d, _mm_movehl_ps(d, d));
+
+		return 0.5f * FastLog2(_mm_cvtss_f32(d));
+	}
+
+	// Sample the texture with the mip level of the 2x2 block.
+	template <U32 Format, typename Sampler>
+	NMJ_FORCEINLINE __m128i SampleTextureFormat(const TextureSetup &texture, TextureBlockCache &cache, __m128 u, __m128 v)
+	{
+		if (texture.mip_count <= 1)
+			return SampleLevel<Format, Sampler>(texture.base, cache, u, v);
+
+		float lod = GetBlockLod(_mm_mul_ps(u, texture.base.size_x), _mm_mul_ps(v, texture.base.size_y));
+		const float max_lod = float(texture.mip_count - 1);
+
+		if (texture.mip_filter == RasterizerMipFilterLinear)
+		{
+			lod = lod > 0.0f ? (lod < max_lod ? lod : max_lod) : 0.0f;
+
+			const U32 level = U32(lod);
+			const U32 weight = U32((lod - float(level)) * 256.0f);
+
+			TextureLevel level0;
+			SetupTextureLevel(level0, texture, level);
+			__m128i result = SampleLevel<Format, Sampler>(level0, cache, u, v);
+
+			// Blend with the next level, unless it wouldn't contribute.
+			if (weight != 0)
+			{
+				TextureLevel level1;
+				SetupTextureLevel(level1, texture, level + 1);
+				result = LerpColor(result, SampleLevel<Format, Sampler>(level1, cache, u, v), weight);
+			}
+			return result;
+		}
+		else
+		{
+			lod += 0.5f;
+			lod = lod > 0.0f ? (lod < max_lod ? lod : max_lod) : 0.0f;
+
+			TextureLevel level;
+			SetupTextureLevel(level, texture, U32(lod));
+			return SampleLevel<Format, Sampler>(level, cache, u, v);
+		}
+	}
+
+	// Sample the texture in its format.
+	template <typename Sampler>
+	NMJ_FORCEINLINE __m128i SampleTexture(const TextureSetup &texture, TextureBlockCache &cache, __m128 u, __m128 v)
+	{
+		switch (texture.format)
+		{
+			case RasterizerTextureFormatBC1: return SampleTextureFormat<RasterizerTextureFormatBC1, Sampler>(texture, cache, u, v);
+			case RasterizerTextureFormatBC3: return SampleTextureFormat<RasterizerTextureFormatBC3, Sampler>(texture, cache, u, v);
+			default:                         return SampleTextureFormat<RasterizerTextureFormatRGBA8, Sampler>(texture, cache, u, v);
+		}
+	}
+
+	// Average 2x2 texel groups of 8x2 texels to 4 texels.
+	NMJ_FORCEINLINE __m128i BoxFilter(__m128i a0, __m128i a1, __m128i b0, __m128i b1)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi16(2);
+
+		// Vertical sums of texels 0-1, 2-3, 4-5 and 6-7 in 16bit.
+		__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+		__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+		__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+		__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+		// Horizontal sums of the neighbouring texels.
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+		__m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+		return _mm_packus_epi16(lo, hi);
+	}
+
+	// Downsample texture level to half resolution with 2x2 box filter.
+	static void DownsampleTextureLevel(U32 *dst, U32 width, U32 height, const U32 *src, U32 src_width, U32 src_height)
+	{
+		// Levels with one texel wide or high source average the same texels twice.
+		const U32 x_step = src_width > 1 ? 1 : 0;
+		const U32 y_step = src_height > 1 ? src_width : 0;
+
+		for (U32 y = 0; y < height; ++y)
+		{
+			const U32 *in0 = src + y * 2 * src_width;
+			const U32 *in1 = in0 + y_step;
+			U32 *out = dst + y * width;
+
+			U32 x = 0;
+			if (x_step)
+			{
+				for (; x + 4 <= width; x += 4)
+				{
+					__m128i a0 = _mm_loadu_si128((const __m128i *)(in0 + x * 2));
+					__m128i a1 = _mm_loadu_si128((const __m128i *)(in0 + x * 2 + 4));
+					__m128i b0 = _mm_loadu_si128((const __m128i *)(in1 + x * 2));
+					__m128i b1 = _mm_loadu_si128((const __m128i *)(in1 + x * 2 + 4));
+					_mm_storeu_si128((__m128i *)(out + x), BoxFilter(a0, a1, b0, b1));
+				}
+			}
+
+			// Remaining texels of narrow levels.
+			for (; x < width; ++x)
+			{
+				const U32 t00 = in0[x * 2];
+				const U32 t10 = in0[x * 2 + x_step];
+				const U32 t01 = in1[x * 2];
+				const U32 t11 = in1[x * 2 + x_step];
+
+				U32 result = 0;
+				for (U32 shift = 0; shift < 32; shift += 8)
+				{
+					const U32 sum = ((t00 >> shift) & 0xFF) + ((t10 >> shift) & 0xFF) + ((t01 >> shift) & 0xFF) + ((t11 >> shift) & 0xFF);
+					result |= ((sum + 2) >> 2) << shift;
+				}
+				out[x] = result;
+			}
+		}
+	}
+
+	// Multiply 8bit color channels, where 255 is one.
+	NMJ_FORCEINLINE __m128i ModulateColor(__m128i a, __m128i b)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi16(255);
+
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		return _mm_packus_epi16(lo, hi);
+	}
+
+	// Get the 8bit alpha of 4 pixels as 16bit weights, where 256 is one, for the 16bit
+	// channels of pixels 0-1 and 2-3.
+	NMJ_FORCEINLINE void GetAlphaWeights(__m128i color, __m128i &lo, __m128i &hi)
+	{
+		__m128i alpha = _mm_srli_epi32(color, 24);
+		alpha = _mm_add_epi32(alpha, _mm_srli_epi32(alpha, 7));
+		alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+		lo = _mm_unpacklo_epi32(alpha, alpha);
+		hi = _mm_unpackhi_epi32(alpha, alpha);
+	}
+
+	// Blend the source color of 4 pixels with the destination color.
+	template <U32 BlendMode>
+	NMJ_FORCEINLINE __m128i BlendColor(__m128i src, __m128i dst)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		switch (BlendMode)
+		{
+			case RasterizerBlendAlpha:
+			{
+				__m128i alpha_lo, alpha_hi;
+				GetAlphaWeights(src, alpha_lo, alpha_hi);
+
+				__m128i lo = LerpEpi16(_mm_unpacklo_epi8(dst, zero), _mm_unpacklo_epi8(src, zero), alpha_lo);
+				__m128i hi = LerpEpi16(_mm_unpackhi_epi8(dst, zero), _mm_unpackhi_epi8(src, zero), alpha_hi);
+				return _mm_packus_epi16(lo, hi);
+			}
+
+			case RasterizerBlendPremultiplied:
+			{
+				__m128i alpha_lo, alpha_hi;
+				GetAlphaWeights(src, alpha_lo, alpha_hi);
+
+				// Scale the destination with inverse alpha and add the source with saturation.
+				const __m128i one = _mm_set1_epi16(256);
+				__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(dst, zero), _mm_sub_epi16(one, alpha_lo)), 8);
+				__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(dst, zero), _mm_sub_epi16(one, alpha_hi)), 8);
+				return _mm_adds_epu8(src, _mm_packus_epi16(lo, hi));
+			}
+
+			case RasterizerBlendAdditive:
+				return _mm_adds_epu8(src, dst);
+
+			case RasterizerBlendMultiply:
+				return ModulateColor(src, dst);
+
+			default:
+				return src;
+		}
+	}
+
+	// Get the mask of pixels passing the alpha test.
+	NMJ_FORCEINLINE __m128i GetAlphaTestMask(const DrawState &draw, __m128i color)
+	{
+		return _mm_xor_si128(_mm_cmplt_epi32(_mm_srli_epi32(color, 24), draw.alpha_ref), _mm_set1_epi32(-1));
+	}
+
+	// Find the nearest and farthest depth values of the depth tile for the hierarchical depth buffer.
+	template <U32 DepthFormat>
+	static void UpdateHiZ(U32 *hiz, const void *depth_buffer)
+	{
+		typedef DepthBufferFormat<DepthFormat> Depth;
+
+		const char *in = (const char *)depth_buffer;
+
+		__m128i min_z = _mm_set1_epi32(0x7FFFFFFF);
+		__m128i max_z = _mm_setzero_si128();
+		for (U32 count = TileSizeXInBlocks * TileSizeYInBlocks; count--; )
+		{
+			__m128i z = Depth::GetDepth(Depth::Load(in));
+			min_z = MinEpi32(min_z, z);
+			max_z = MaxEpi32(max_z, z);
+			in += Depth::BlockBytes;
+		}
+
+		min_z = MinEpi32(min_z, _mm_shuffle_epi32(min_z, _MM_SHUFFLE(1, 0, 3, 2)));
+		min_z = MinEpi32(min_z, _mm_shuffle_epi32(min_z, _MM_SHUFFLE(2, 3, 0, 1)));
+		max_z = MaxEpi32(max_z, _mm_shuffle_epi32(max_z, _MM_SHUFFLE(1, 0, 3, 2)));
+		max_z = MaxEpi32(max_z, _mm_shuffle_epi32(max_z, _MM_SHUFFLE(2, 3, 0, 1)));
+		hiz[0] = U32(_mm_cvtsi128_si32(min_z));
+		hiz[1] = U32(_mm_cvtsi128_si32(max_z));
+	}
+
+	// Test if the triangle fails the depth test against the whole tile.
+	template <U32 DepthFormat, U32 DepthCompare>
+	NMJ_FORCEINLINE bool IsOccludedByHiZ(__m128 z0, __m128 z1, __m128 z2, const U32 *hiz)
+	{
+		typedef DepthBufferFormat<DepthFormat> Depth;
+
+		if (DepthCompare == RasterizerCompareAlways || hiz == NULL)
+			return false;
+
+		__m128 zmin = _mm_min_ps(_mm_min_ps(z0, z1), z2);
+		__m128 zmax = _mm_max_ps(_mm_max_ps(z0, z1), z2);
+
+		// The interpolated depth may overshoot the vertex depths because of the
+		// approximated reciprocals used in the barycentric setup, so be conservative.
+		__m128 margin = _mm_mul_ss(_mm_sub_ss(zmax, zmin), _mm_set_ss(1.0f / 1024.0f));
+		const S32 nearest_z = Depth::Encode(_mm_cvtss_f32(_mm_sub_ss(zmin, margin))) - 1;
+		const S32 farthest_z = Depth::Encode(_mm_cvtss_f32(_mm_add_ss(zmax, margin))) + 1;
+
+		const S32 tile_min_z = S32(hiz[0]);
+		const S32 tile_max_z = S32(hiz[1]);
+		switch (DepthCompare)
+		{
+			case RasterizerCompareLess:      return nearest_z >= tile_max_z;
+			case RasterizerCompareLessEqual: return nearest_z > tile_max_z;
+			case RasterizerCompareGreater:   return farthest_z <= tile_min_z;
+			case RasterizerCompareEqual:     return nearest_z > tile_max_z || farthest_z < tile_min_z;
+			default:                       return false;
+		}
+	}
+
+	// Number of interpolated attributes for lighting, the normal and the position.
+	enum { LightAttributeCount = 6 };
+
+	// Dot product of 3 component vectors of 4 pixels.
+	NMJ_FORCEINLINE __m128 Dot3(const __m128 (&a)[3], const __m128 (&b)[3])
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+	}
+
+	// Normalize 3 component vectors of 4 pixels.
+	NMJ_FORCEINLINE void Normalize3(__m128 (&v)[3])
+	{
+		__m128 inv_length = _mm_rsqrt_ps(_mm_max_ps(Dot3(v, v), _mm_set1_ps(1e-12f)));
+		v[0] = _mm_mul_ps(v[0], inv_length);
+		v[1] = _mm_mul_ps(v[1], inv_length);
+		v[2] = _mm_mul_ps(v[2], inv_length);
+	}
+
+	// Convert RGB light of 4 pixels to 8bit color channels, saturating at one.
+	NMJ_FORCEINLINE __m128i PackLight(const __m128 (&light)[3], __m128i alpha)
+	{
+		const __m128 scale = _mm_set1_ps(255.0f);
+		__m128i r = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(light[0], scale), scale));
+		__m128i g = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(light[1], scale), scale));
+		__m128i b = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(light[2], scale), scale));
+		return _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), alpha));
+	}
+
+	// Light the color of the 2x2 pixel block with the interpolated normal and position.
+	template <U32 Lighting>
+	NMJ_FORCEINLINE __m128i LightBlock(const RasterizerLighting &lighting, const __m128 (&pers_light)[LightAttributeCount], __m128 w, __m128i color)
+	{
+		__m128 normal[3] = { _mm_mul_ps(pers_light[0], w), _mm_mul_ps(pers_light[1], w), _mm_mul_ps(pers_light[2], w) };
+		__m128 position[3] = { _mm_mul_ps(pers_light[3], w), _mm_mul_ps(pers_light[4], w), _mm_mul_ps(pers_light[5], w) };
+		Normalize3(normal);
+
+		__m128 view[3];
+		if (Lighting == RasterizerLightingBlinnPhong)
+		{
+			view[0] = _mm_sub_ps(_mm_set1_ps(lighting.eye_position[0]), position[0]);
+			view[1] = _mm_sub_ps(_mm_set1_ps(lighting.eye_position[1]), position[1]);
+			view[2] = _mm_sub_ps(_mm_set1_ps(lighting.eye_position[2]), position[2]);
+			Normalize3(view);
+		}
+
+		__m128 diffuse[3] = { _mm_set1_ps(lighting.ambient[0]), _mm_set1_ps(lighting.ambient[1]), _mm_set1_ps(lighting.ambient[2]) };
+		__m128 specular[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+
+		for (U32 i = 0; i < lighting.light_count; ++i)
+		{
+			const RasterizerLight &light = lighting.lights[i];
+
+			// Light direction and attenuation
+			__m128 dir[3];
+			__m128 attenuation;
+			if (light.type == RasterizerLightPoint)
+			{
+				dir[0] = _mm_sub_ps(_mm_set1_ps(light.position[0]), position[0]);
+				dir[1] = _mm_sub_ps(_mm_set1_ps(light.position[1]), position[1]);
+				dir[2] = _mm_sub_ps(_mm_set1_ps(light.position[2]), position[2]);
+
+				__m128 distance_sq = Dot3(dir, dir);
+				__m128 inv_distance = _mm_rsqrt_ps(_mm_max_ps(distance_sq, _mm_set1_ps(1e-12f)));
+				dir[0] = _mm_mul_ps(dir[0], inv_distance);
+				dir[1] = _mm_mul_ps(dir[1], inv_distance);
+				dir[2] = _mm_mul_ps(dir[2], inv_distance);
+
+				const float inv_range_sq = 1.0f / (light.range * light.range);
+				attenuation = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(distance_sq, _mm_set1_ps(inv_range_sq))), zero);
+			}
+			else
+			{
+				dir[0] = _mm_set1_ps(light.position[0]);
+				dir[1] = _mm_set1_ps(light.position[1]);
+				dir[2] = _mm_set1_ps(light.position[2]);
+				attenuation = one;
+			}
+
+			__m128 n_dot_l = _mm_max_ps(Dot3(normal, dir), zero);
+			__m128 intensity = _mm_mul_ps(n_dot_l, attenuation);
+			diffuse[0] = _mm_add_ps(diffuse[0], _mm_mul_ps(intensity, _mm_set1_ps(light.color[0])));
+			diffuse[1] = _mm_add_ps(diffuse[1], _mm_mul_ps(intensity, _mm_set1_ps(light.color[1])));
+			diffuse[2] = _mm_add_ps(diffuse[2], _mm_mul_ps(intensity, _mm_set1_ps(light.color[2])));
+
+			if (Lighting == RasterizerLightingBlinnPhong)
+			{
+				__m128 half[3] = { _mm_add_ps(dir[0], view[0]), _mm_add_ps(dir[1], view[1]), _mm_add_ps(dir[2], view[2]) };
+				Normalize3(half);
+
+				// Approximate pow(x, n) with x / (n - (n - 1) * x), which avoids exp and log.
+				const float power = lighting.specular_power;
+				__m128 n_dot_h = _mm_max_ps(Dot3(normal, half), zero);
+				__m128 denominator = _mm_sub_ps(_mm_set1_ps(power), _mm_mul_ps(_mm_set1_ps(power - 1.0f), n_dot_h));
+				__m128 highlight = _mm_div_ps(n_dot_h, _mm_max_ps(denominator, _mm_set1_ps(1e-6f)));
+
+				// No highlights on the back faces towards the light.
+				highlight = _mm_and_ps(highlight, _mm_cmpgt_ps(n_dot_l, zero));
+				highlight = _mm_mul_ps(highlight, attenuation);
+				specular[0] = _mm_add_ps(specular[0], _mm_mul_ps(highlight, _mm_set1_ps(light.color[0] * lighting.specular[0])));
+				specular[1] = _mm_add_ps(specular[1], _mm_mul_ps(highlight, _mm_set1_ps(light.color[1] * lighting.specular[1])));
+				specular[2] = _mm_add_ps(specular[2], _mm_mul_ps(highlight, _mm_set1_ps(light.color[2] * lighting.specular[2])));
+			}
+		}
+
+		// Keep the alpha of the color.
+		color = ModulateColor(color, PackLight(diffuse, _mm_set1_epi32(0xFF000000)));
+		if (Lighting == RasterizerLightingBlinnPhong)
+			color = _mm_adds_epu8(color, PackLight(specular, _mm_setzero_si128()));
+		return color;
+	}
+
+	// Shade the color of the 2x2 pixel block from the perspective interpolated attributes.
+	template <bool DiffuseMap, bool VertexColor, bool VertexAlpha, U32 Lighting, typename Sampler>
+	NMJ_FORCEINLINE __m128i ShadeBlock(
+		const __m128 (&pers_color)[4], const __m128 (&pers_uv)[2], const __m128 (&pers_light)[LightAttributeCount], __m128 inv_w, __m128i mask,
+		const TextureSetup &texture, TextureBlockCache &texture_cache, const RasterizerLighting *lighting)
+	{
+		__m128 w = _mm_rcp_ps(inv_w);
+
+		__m128i new_color;
+
+		if (VertexColor)
+		{
+			__m128i x = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[0], w), _mm_set1_ps(255.0f)));
+			__m128i y = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[1], w), _mm_set1_ps(255.0f)));
+			__m128i z = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[2], w), _mm_set1_ps(255.0f)));
+
+			new_color = _mm_or_si128(_mm_or_si128(x, _mm_slli_epi32(y, 8)), _mm_slli_epi32(z, 16));
+
+			if (VertexAlpha)
+			{
+				__m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[3], w), _mm_set1_ps(255.0f)));
+				new_color = _mm_or_si128(new_color, _mm_slli_epi32(a, 24));
+			}
+		}
+
+		if (DiffuseMap)
+		{
+			__m128i texel = SampleTexture<Sampler>(texture, texture_cache, _mm_mul_ps(pers_uv[0], w), _mm_mul_ps(pers_uv[1], w));
+
+			// Vertex alpha is only interpolated for blending and alpha test, otherwise modulate with opaque vertex color.
+			if (VertexColor && VertexAlpha)
+				new_color = ModulateColor(texel, new_color);
+			else if (VertexColor)
+				new_color = ModulateColor(texel, _mm_or_si128(new_color, _mm_set1_epi32(0xFF000000)));
+			else
+				new_color = texel;
+		}
+
+		if (!VertexColor && !DiffuseMap)
+		{
+			new_color = mask;
+		}
+
+		if (Lighting != RasterizerLightingNone)
+			new_color = LightBlock<Lighting>(*lighting, pers_light, w, new_color);
+
+		return new_color;
+	}
+
+	// Use template to easily generate multiple functions with different rasterizer state.
+	template <bool ColorWrite, bool DepthWrite, bool DepthTest, bool DiffuseMap, bool VertexColor, U32 BlendMode, bool AlphaTest, U32 Lighting, U32 DepthFormat, U32 DepthCompare, bool Stencil, typename Sampler>
+	static U32 RasterizeTile(
+		U32 tile_x, U32 tile_y,
+		U32 screen_width, U32 screen_height,
+		void *color_buffer, void *depth_buffer, U32 *hiz,
+		const DrawState &draw, const RasterizerInput &input)
+	{
+		typedef DepthBufferFormat<DepthFormat> Depth;
+		NMJ_STATIC_ASSERT(!Stencil || DepthFormat == RasterizerDepthFormatD24S8, "Stencil requires D24S8 format.");
+
+		enum { DepthBufferAccess = DepthTest || DepthWrite || Stencil };
 
-			transform_matrix[0] = _mm_mul_ps(transform_matrix[0], scale);
-			transform_matrix[1] = _mm_mul_ps(transform_matrix[1], neg_scale);
-			transform_matrix[2] = _mm_mul_ps(transform_matrix[2], scale);
-			transform_matrix[3] = _mm_mul_ps(transform_matrix[3], scale);
-		}
+		// Color is also shaded without color writes for the alpha test.
+		enum { ColorShading = ColorWrite || AlphaTest };
+
+		// Vertex alpha is only interpolated, when the color is blended with the color buffer or alpha tested.
+		enum { VertexAlpha = BlendMode != RasterizerBlendNone || AlphaTest };
+		enum { ColorChannels = VertexAlpha ? 4 : 3 };
+
+		TileSetup tile;
+		SetupTile(tile, tile_x, tile_y, screen_width, screen_height, input);
 
 		const float *vertices = input.vertices;
 		const float *colors = input.colors;
-		// const float *texcoords = input.texcoords;
+		const float *texcoords = input.texcoords;
+		const float *normals = input.normals;
 		const U16 *indices = input.indices;
 
-		for (U32 count = input.triangle_count; count--; )
+		// Lighting is only applied to the written color.
+		enum { ColorLighting = ColorWrite ? Lighting : RasterizerLightingNone };
+		const RasterizerLighting *lighting = input.lighting;
+
+		TextureSetup texture;
+		TextureBlockCache texture_cache;
+		if (ColorShading && DiffuseMap)
 		{
-			// Fetch triangle vertex information
-			__declspec(align(16)) float v[3][4];
-			float c[3][3];
-			{
-				const U16 i0 = indices[0];
-				const U16 i1 = indices[1];
-				const U16 i2 = indices[2];
-
-				v[0][0] = vertices[i0 * 3 + 0];
-				v[0][1] = vertices[i0 * 3 + 1];
-				v[0][2] = vertices[i0 * 3 + 2];
-				v[1][0] = vertices[i1 * 3 + 0];
-				v[1][1] = vertices[i1 * 3 + 1];
-				v[1][2] = vertices[i1 * 3 + 2];
-				v[2][0] = vertices[i2 * 3 + 0];
-				v[2][1] = vertices[i2 * 3 + 1];
-				v[2][2] = vertices[i2 * 3 + 2];
-
-				if (VertexColor)
-				{
-					c[0][0] = colors[i0 * 4 + 0];
-					c[0][1] = colors[i0 * 4 + 1];
-					c[0][2] = colors[i0 * 4 + 2];
-					// c[0][3] = colors[i0 * 4 + 3];
-					c[1][0] = colors[i1 * 4 + 0];
-					c[1][1] = colors[i1 * 4 + 1];
-					c[1][2] = colors[i1 * 4 + 2];
-					// c[1][3] = colors[i1 * 4 + 3];
-					c[2][0] = colors[i2 * 4 + 0];
-					c[2][1] = colors[i2 * 4 + 1];
-					c[2][2] = colors[i2 * 4 + 2];
-					// c[2][3] = colors[i2 * 4 + 3];
-				}
+			SetupTexture(texture, *input.diffuse_map, input.diffuse_sampler);
+			InitializeTextureBlockCache(texture_cache);
+		}
 
-				indices += 3;
-			}
+		bool depth_written = false;
 
-			// Transform vertices
-			for (unsigned i = 0; i < 3; ++i)
-			{
-				__m128 result;
-				result = _mm_mul_ps(transform_matrix[0], _mm_set1_ps(v[i][0]));
-				result = _mm_add_ps(result, _mm_mul_ps(transform_matrix[1], _mm_set1_ps(v[i][1])));
-				result = _mm_add_ps(result, _mm_mul_ps(transform_matrix[2], _mm_set1_ps(v[i][2])));
-				result = _mm_add_ps(result, transform_matrix[3]);
-				_mm_store_ps(v[i], result);
-			}
+		U32 visible_samples = 0;
 
-			// Hack rejection for planes, that cross near plane
-			if (v[0][2] < 0.0f || v[1][2] < 0.0f || v[2][2] < 0.0f)
+		for (U32 count = input.triangle_count; count--; indices += 3)
+		{
+			TriangleSetup tri;
+			if (!SetupTriangle(tri, tile, vertices, indices))
 				continue;
 
-			// Convert to clip space coordinates to fixed point screen space coordinates.
-			S32 coord[3][2];
-			coord[0][0] = S32(v[0][0] / v[0][3]);
-			coord[0][1] = S32(v[0][1] / v[0][3]);
-			coord[1][0] = S32(v[1][0] / v[1][3]);
-			coord[1][1] = S32(v[1][1] / v[1][3]);
-			coord[2][0] = S32(v[2][0] / v[2][3]);
-			coord[2][1] = S32(v[2][1] / v[2][3]);
-
-			// Some common constants for the barycentric calculations.
-			const S32 coord21x = coord[2][0] - coord[1][0];
-			const S32 coord21y = coord[2][1] - coord[1][1];
-			const S32 coord02x = coord[0][0] - coord[2][0];
-			const S32 coord02y = coord[0][1] - coord[2][1];
-
-			// Triangle area * 2
-			const S32 triarea_x2 = -((coord02x * coord21y) >> PixelFracBits) + ((coord02y * coord21x) >> PixelFracBits);
-			if (triarea_x2 < 0)
-				continue;
+			const float (&v)[3][4] = tri.v;
 
-			// Calculate bounds
-			S32 bounds[2][2];
-			bounds[0][0] = (Min(Min(coord[0][0], coord[1][0]), coord[2][0]) + (PixelFracUnit - 1)) >> PixelFracBits;
-			bounds[0][1] = (Min(Min(coord[0][1], coord[1][1]), coord[2][1]) + (PixelFracUnit - 1)) >> PixelFracBits;
-			bounds[1][0] = (Max(Max(coord[0][0], coord[1][0]), coord[2][0]) + (PixelFracUnit - 1)) >> PixelFracBits;
-			bounds[1][1] = (Max(Max(coord[0][1], coord[1][1]), coord[2][1]) + (PixelFracUnit - 1)) >> PixelFracBits;
+			// Reject triangles that fail the depth test for the whole tile, before any attribute setup.
+			if (DepthTest && (!Stencil || draw.stencil_allows_hiz))
+			{
+				__m128 z0 = _mm_mul_ps(_mm_set1_ps(v[0][2]), _mm_rcp_ps(_mm_set1_ps(v[0][3])));
+				__m128 z1 = _mm_mul_ps(_mm_set1_ps(v[1][2]), _mm_rcp_ps(_mm_set1_ps(v[1][3])));
+				__m128 z2 = _mm_mul_ps(_mm_set1_ps(v[2][2]), _mm_rcp_ps(_mm_set1_ps(v[2][3])));
+				if (IsOccludedByHiZ<DepthFormat, DepthCompare>(z0, z1, z2, hiz))
+					continue;
+			}
 
-			// Clip off-tile triangles.
-			// NOTE: If the binning process would be accurate enough, we could just ignore this.
-			if (bounds[0][0] > tile_max_x || bounds[0][1] > tile_max_y)
-				continue;
-			if (bounds[1][0] < tile_min_x || bounds[1][1] < tile_min_y)
-				continue;
+			// Fetch vertex colors
+			float c[3][4];
+			if (VertexColor)
+			{
+				const U16 i0 = tri.index[0];
+				const U16 i1 = tri.index[1];
+				const U16 i2 = tri.index[2];
+
+				c[0][0] = colors[i0 * 4 + 0];
+				c[0][1] = colors[i0 * 4 + 1];
+				c[0][2] = colors[i0 * 4 + 2];
+				c[1][0] = colors[i1 * 4 + 0];
+				c[1][1] = colors[i1 * 4 + 1];
+				c[1][2] = colors[i1 * 4 + 2];
+				c[2][0] = colors[i2 * 4 + 0];
+				c[2][1] = colors[i2 * 4 + 1];
+				c[2][2] = colors[i2 * 4 + 2];
+
+				if (VertexAlpha)
+				{
+					c[0][3] = colors[i0 * 4 + 3];
+					c[1][3] = colors[i1 * 4 + 3];
+					c[2][3] = colors[i2 * 4 + 3];
+				}
+			}
 
-			// Make sure that the bounds are block aligned
-			bounds[0][0] = Max(Min(bounds[0][0], tile_max_x), tile_min_x) & ~(BlockSizeX - 1);
-			bounds[0][1] = Max(Min(bounds[0][1], tile_max_y), tile_min_y) & ~(BlockSizeY - 1);
-			bounds[1][0] = (Max(Min(bounds[1][0] + 1, tile_max_x), tile_min_x) + (BlockSizeX - 1)) & ~(BlockSizeX - 1);
-			bounds[1][1] = (Max(Min(bounds[1][1] + 1, tile_max_y), tile_min_y) + (BlockSizeY - 1)) & ~(BlockSizeY - 1);
+			// Fetch texture coordinates
+			float t[3][2];
+			if (DiffuseMap)
+			{
+				const U16 i0 = tri.index[0];
+				const U16 i1 = tri.index[1];
+				const U16 i2 = tri.index[2];
+
+				t[0][0] = texcoords[i0 * 2 + 0];
+				t[0][1] = texcoords[i0 * 2 + 1];
+				t[1][0] = texcoords[i1 * 2 + 0];
+				t[1][1] = texcoords[i1 * 2 + 1];
+				t[2][0] = texcoords[i2 * 2 + 0];
+				t[2][1] = texcoords[i2 * 2 + 1];
+			}
 
-			// Calculate variables for stepping
-			__m128i bcoord_row[3], bcoord_xstep[3], bcoord_ystep[3];
-			__m128 inv_w_row, inv_w_xstep, inv_w_ystep;
-			__m128 z_row, z_xstep, z_ystep;
-			__m128 pers_color_row[3], pers_color_xstep[3], pers_color_ystep[3];
+			// Fetch normals and positions for lighting
+			float l[3][LightAttributeCount];
+			if (ColorLighting != RasterizerLightingNone)
 			{
-				// Barycentric integer coordinates
+				for (unsigned i = 0; i < 3; ++i)
 				{
-					__m128i offsetx = _mm_add_epi32(_mm_set1_epi32(bounds[0][0]), _mm_set_epi32(1, 0, 1, 0));
-					__m128i offsety = _mm_add_epi32(_mm_set1_epi32(bounds[0][1]), _mm_set_epi32(1, 1, 0, 0));
-
-					// 1x1 block steps
-					bcoord_xstep[0] = _mm_set1_epi32(-coord21y);
-					bcoord_xstep[1] = _mm_set1_epi32(-coord02y);
-					bcoord_xstep[2] = _mm_set1_epi32(coord[0][1] - coord[1][1]);
-					bcoord_ystep[0] = _mm_set1_epi32(coord21x);
-					bcoord_ystep[1] = _mm_set1_epi32(coord02x);
-					bcoord_ystep[2] = _mm_set1_epi32(coord[1][0] - coord[0][0]);
-
-					// Triangle start position
-					bcoord_row[0] = _mm_set1_epi32(((coord21x * -coord[1][1]) >> PixelFracBits) - ((coord21y * -coord[1][0]) >> PixelFracBits));
-					bcoord_row[0] = _mm_add_epi32(bcoord_row[0], MulEpi32(offsetx, bcoord_xstep[0]));
-					bcoord_row[0] = _mm_add_epi32(bcoord_row[0], MulEpi32(offsety, bcoord_ystep[0]));
-					bcoord_row[0] = _mm_sub_epi32(bcoord_row[0], _mm_srai_epi32(bcoord_xstep[0], 1));
-					bcoord_row[0] = _mm_sub_epi32(bcoord_row[0], _mm_srai_epi32(bcoord_ystep[0], 1));
-					bcoord_row[1] = _mm_set1_epi32(((coord02x * -coord[2][1]) >> PixelFracBits) - ((coord02y * -coord[2][0]) >> PixelFracBits));
-					bcoord_row[1] = _mm_add_epi32(bcoord_row[1], MulEpi32(offsetx, bcoord_xstep[1]));
-					bcoord_row[1] = _mm_add_epi32(bcoord_row[1], MulEpi32(offsety, bcoord_ystep[1]));
-					bcoord_row[1] = _mm_sub_epi32(bcoord_row[1], _mm_srai_epi32(bcoord_xstep[1], 1));
-					bcoord_row[1] = _mm_sub_epi32(bcoord_row[1], _mm_srai_epi32(bcoord_ystep[1], 1));
-
-					// Change stepping to 2x2 blocks
-					bcoord_xstep[0] = _mm_slli_epi32(bcoord_xstep[0], 1);
-					bcoord_xstep[1] = _mm_slli_epi32(bcoord_xstep[1], 1);
-					bcoord_xstep[2] = _mm_slli_epi32(bcoord_xstep[2], 1);
-					bcoord_ystep[0] = _mm_slli_epi32(bcoord_ystep[0], 1);
-					bcoord_ystep[1] = _mm_slli_epi32(bcoord_ystep[1], 1);
-					bcoord_ystep[2] = _mm_slli_epi32(bcoord_ystep[2], 1);
-
-					bcoord_row[2] = _mm_sub_epi32(_mm_sub_epi32(_mm_set1_epi32(triarea_x2), bcoord_row[0]), bcoord_row[1]);
+					const U16 index = tri.index[i];
+					l[i][0] = normals[index * 3 + 0];
+					l[i][1] = normals[index * 3 + 1];
+					l[i][2] = normals[index * 3 + 2];
+					l[i][3] = vertices[index * 3 + 0];
+					l[i][4] = vertices[index * 3 + 1];
+					l[i][5] = vertices[index * 3 + 2];
 				}
+			}
 
-				// Normalized barycentric coordinates as floating point.
-				__m128 inv_triarea_x2f = _mm_rcp_ps(_mm_cvtepi32_ps(_mm_set1_epi32(triarea_x2)));
-				__m128 bcoordf_row1 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_row[1]), inv_triarea_x2f);
-				__m128 bcoordf_row2 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_row[2]), inv_triarea_x2f);
-				__m128 bcoordf_xstep1 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_xstep[1]), inv_triarea_x2f);
-				__m128 bcoordf_xstep2 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_xstep[2]), inv_triarea_x2f);
-				__m128 bcoordf_ystep1 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_ystep[1]), inv_triarea_x2f);
-				__m128 bcoordf_ystep2 = _mm_mul_ps(_mm_cvtepi32_ps(bcoord_ystep[2]), inv_triarea_x2f);
-
+			// Calculate variables for stepping
+			__m128 inv_w_row, inv_w_xstep, inv_w_ystep;
+			__m128 z_row, z_xstep, z_ystep;
+			__m128 pers_color_row[4], pers_color_xstep[4], pers_color_ystep[4];
+			__m128 pers_uv_row[2], pers_uv_xstep[2], pers_uv_ystep[2];
+			__m128 pers_light_row[LightAttributeCount], pers_light_xstep[LightAttributeCount], pers_light_ystep[LightAttributeCount];
+			{
 				// W interpolation
 				__m128 inv_w0 = _mm_rcp_ps(_mm_set1_ps(v[0][3]));
 				__m128 inv_w1 = _mm_rcp_ps(_mm_set1_ps(v[1][3]));
 				__m128 inv_w2 = _mm_rcp_ps(_mm_set1_ps(v[2][3]));
-				__m128 inv_w10 = _mm_sub_ps(inv_w1, inv_w0);
-				__m128 inv_w20 = _mm_sub_ps(inv_w2, inv_w0);
-				inv_w_row = _mm_add_ps(inv_w0, _mm_add_ps(_mm_mul_ps(inv_w10, bcoordf_row1), _mm_mul_ps(inv_w20, bcoordf_row2)));
-				inv_w_xstep = _mm_add_ps(_mm_mul_ps(inv_w10, bcoordf_xstep1), _mm_mul_ps(inv_w20, bcoordf_xstep2));
-				inv_w_ystep = _mm_add_ps(_mm_mul_ps(inv_w10, bcoordf_ystep1), _mm_mul_ps(inv_w20, bcoordf_ystep2));
+				SetupLinearAttribute(tri, inv_w0, inv_w1, inv_w2, inv_w_row, inv_w_xstep, inv_w_ystep);
 
 				// Z interpolation
 				if (DepthWrite || DepthTest)
 				{
 					__m128 z0 = _mm_mul_ps(_mm_set1_ps(v[0][2]), inv_w0);
-					__m128 z10 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(v[1][2]), inv_w1), z0);
-					__m128 z20 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(v[2][2]), inv_w2), z0);
-					z_row = _mm_add_ps(z0, _mm_add_ps(_mm_mul_ps(z10, bcoordf_row1), _mm_mul_ps(z20, bcoordf_row2)));
-					z_xstep = _mm_add_ps(_mm_mul_ps(z10, bcoordf_xstep1), _mm_mul_ps(z20, bcoordf_xstep2));
-					z_ystep = _mm_add_ps(_mm_mul_ps(z10, bcoordf_ystep1), _mm_mul_ps(z20, bcoordf_ystep2));
+					__m128 z1 = _mm_mul_ps(_mm_set1_ps(v[1][2]), inv_w1);
+					__m128 z2 = _mm_mul_ps(_mm_set1_ps(v[2][2]), inv_w2);
+					SetupLinearAttribute(tri, z0, z1, z2, z_row, z_xstep, z_ystep);
 				}
 
 				// Color interpolation
-				if (ColorWrite && VertexColor)
+				if (ColorShading && VertexColor)
+				{
+					for (unsigned i = 0; i < ColorChannels; ++i)
+					{
+						__m128 pers_color0 = _mm_mul_ps(_mm_set1_ps(c[0][i]), inv_w0);
+						__m128 pers_color1 = _mm_mul_ps(_mm_set1_ps(c[1][i]), inv_w1);
+						__m128 pers_color2 = _mm_mul_ps(_mm_set1_ps(c[2][i]), inv_w2);
+						SetupLinearAttribute(tri, pers_color0, pers_color1, pers_color2, pers_color_row[i], pers_color_xstep[i], pers_color_ystep[i]);
+					}
+				}
+
+				// Texture coordinate interpolation
+				if (ColorShading && DiffuseMap)
+				{
+					for (unsigned i = 0; i < 2; ++i)
+					{
+						__m128 pers_uv0 = _mm_mul_ps(_mm_set1_ps(t[0][i]), inv_w0);
+						__m128 pers_uv1 = _mm_mul_ps(_mm_set1_ps(t[1][i]), inv_w1);
+						__m128 pers_uv2 = _mm_mul_ps(_mm_set1_ps(t[2][i]), inv_w2);
+						SetupLinearAttribute(tri, pers_uv0, pers_uv1, pers_uv2, pers_uv_row[i], pers_uv_xstep[i], pers_uv_ystep[i]);
+					}
+				}
+
+				// Normal and position interpolation
+				if (ColorLighting != RasterizerLightingNone)
 				{
-					__m128 pers_color0x = _mm_mul_ps(_mm_set1_ps(c[0][0]), inv_w0);
-					__m128 pers_color0y = _mm_mul_ps(_mm_set1_ps(c[0][1]), inv_w0);
-					__m128 pers_color0z = _mm_mul_ps(_mm_set1_ps(c[0][2]), inv_w0);
-					__m128 pers_color10x = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[1][0]), inv_w1), pers_color0x);
-					__m128 pers_color10y = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[1][1]), inv_w1), pers_color0y);
-					__m128 pers_color10z = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[1][2]), inv_w1), pers_color0z);
-					__m128 pers_color20x = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[2][0]), inv_w2), pers_color0x);
-					__m128 pers_color20y = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[2][1]), inv_w2), pers_color0y);
-					__m128 pers_color20z = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c[2][2]), inv_w2), pers_color0z);
-					pers_color_row[0] = _mm_add_ps(pers_color0x, _mm_add_ps(_mm_mul_ps(pers_color10x, bcoordf_row1), _mm_mul_ps(pers_color20x, bcoordf_row2)));
-					pers_color_row[1] = _mm_add_ps(pers_color0y, _mm_add_ps(_mm_mul_ps(pers_color10y, bcoordf_row1), _mm_mul_ps(pers_color20y, bcoordf_row2)));
-					pers_color_row[2] = _mm_add_ps(pers_color0z, _mm_add_ps(_mm_mul_ps(pers_color10z, bcoordf_row1), _mm_mul_ps(pers_color20z, bcoordf_row2)));
-					pers_color_xstep[0] = _mm_add_ps(_mm_mul_ps(pers_color10x, bcoordf_xstep1), _mm_mul_ps(pers_color20x, bcoordf_xstep2));
-					pers_color_xstep[1] = _mm_add_ps(_mm_mul_ps(pers_color10y, bcoordf_xstep1), _mm_mul_ps(pers_color20y, bcoordf_xstep2));
-					pers_color_xstep[2] = _mm_add_ps(_mm_mul_ps(pers_color10z, bcoordf_xstep1), _mm_mul_ps(pers_color20z, bcoordf_xstep2));
-					pers_color_ystep[0] = _mm_add_ps(_mm_mul_ps(pers_color10x, bcoordf_ystep1), _mm_mul_ps(pers_color20x, bcoordf_ystep2));
-					pers_color_ystep[1] = _mm_add_ps(_mm_mul_ps(pers_color10y, bcoordf_ystep1), _mm_mul_ps(pers_color20y, bcoordf_ystep2));
-					pers_color_ystep[2] = _mm_add_ps(_mm_mul_ps(pers_color10z, bcoordf_ystep1), _mm_mul_ps(pers_color20z, bcoordf_ystep2));
+					for (unsigned i = 0; i < LightAttributeCount; ++i)
+					{
+						__m128 pers_light0 = _mm_mul_ps(_mm_set1_ps(l[0][i]), inv_w0);
+						__m128 pers_light1 = _mm_mul_ps(_mm_set1_ps(l[1][i]), inv_w1);
+						__m128 pers_light2 = _mm_mul_ps(_mm_set1_ps(l[2][i]), inv_w2);
+						SetupLinearAttribute(tri, pers_light0, pers_light1, pers_light2, pers_light_row[i], pers_light_xstep[i], pers_light_ystep[i]);
+					}
 				}
 			}
 
 			// Output buffer
 			char *out_color_row;
 			char *out_depth_row;
-			U32 xcount, ycount;
+			const U32 xcount = tri.xcount;
+			const U32 ycount = tri.ycount;
 			{
-				S32 tile_begin_x = (bounds[0][0] - tile_min_x) / BlockSizeX;
-				S32 tile_begin_y = (bounds[0][1] - tile_min_y) / BlockSizeY;
-				S32 tile_end_x = (bounds[1][0] - tile_min_x) / BlockSizeX;
-				S32 tile_end_y = (bounds[1][1] - tile_min_y) / BlockSizeY;
-
-				xcount = tile_end_x - tile_begin_x;
-				ycount = tile_end_y - tile_begin_y;
-
 				if (ColorWrite)
 				{
 					out_color_row = (char *)color_buffer;
-					out_color_row += tile_begin_y * ColorTilePitch + tile_begin_x * ColorBlockBytes;
+					out_color_row += tri.block_offset_y * ColorTilePitch + tri.block_offset_x * ColorBlockBytes;
 				}
-				if (DepthWrite || DepthTest)
+				if (DepthBufferAccess)
 				{
 					out_depth_row = (char *)depth_buffer;
-					out_depth_row += tile_begin_y * DepthTilePitch + tile_begin_x * DepthBlockBytes;
+					out_depth_row += tri.block_offset_y * Depth::TilePitch + tri.block_offset_x * Depth::BlockBytes;
 				}
 			}
 
@@ -346,7 +1680,7 @@ namespace nmj
 				{
 					if (ColorWrite)
 						out_color = out_color_row;
-					if (DepthWrite || DepthTest)
+					if (DepthBufferAccess)
 						out_depth = out_depth_row;
 				}
 
@@ -354,22 +1688,38 @@ namespace nmj
 				__m128i bcoord[3];
 				__m128 inv_w;
 				__m128 z;
-				__m128 pers_color[3];
+				__m128 pers_color[4];
+				__m128 pers_uv[2];
+				__m128 pers_light[LightAttributeCount];
 				{
-					bcoord[0] = bcoord_row[0];
-					bcoord[1] = bcoord_row[1];
-					bcoord[2] = bcoord_row[2];
+					bcoord[0] = tri.bcoord_row[0];
+					bcoord[1] = tri.bcoord_row[1];
+					bcoord[2] = tri.bcoord_row[2];
 
 					inv_w = inv_w_row;
 
 					if (DepthWrite || DepthTest)
 						z = z_row;
 
-					if (ColorWrite && VertexColor)
+					if (ColorShading && VertexColor)
 					{
 						pers_color[0] = pers_color_row[0];
 						pers_color[1] = pers_color_row[1];
 						pers_color[2] = pers_color_row[2];
+						if (VertexAlpha)
+							pers_color[3] = pers_color_row[3];
+					}
+
+					if (ColorShading && DiffuseMap)
+					{
+						pers_uv[0] = pers_uv_row[0];
+						pers_uv[1] = pers_uv_row[1];
+					}
+
+					if (ColorLighting != RasterizerLightingNone)
+					{
+						for (unsigned i = 0; i < LightAttributeCount; ++i)
+							pers_light[i] = pers_light_row[i];
 					}
 				}
 
@@ -383,51 +1733,80 @@ namespace nmj
 					if (_mm_movemask_epi8(mask) == 0)
 						goto skip_block;
 
-					// Depth buffering
-					if (DepthTest || DepthWrite)
+					// Shade before the depth and stencil writes, so the alpha test can discard pixels.
+					__m128i new_color;
+					if (AlphaTest)
 					{
-						__m128i old_z = _mm_load_si128((__m128i *)out_depth);
-						__m128i new_z = _mm_cvtps_epi32(_mm_mul_ps(z, _mm_set1_ps(float(0xFFFFFF))));
+						new_color = ShadeBlock<DiffuseMap, VertexColor, VertexAlpha, RasterizerLightingNone, Sampler>(pers_color, pers_uv, pers_light, inv_w, mask, texture, texture_cache, lighting);
+
+						mask = _mm_and_si128(mask, GetAlphaTestMask(draw, new_color));
+						if (_mm_movemask_epi8(mask) == 0)
+							goto skip_block;
+					}
+
+					// Depth and stencil buffering
+					if (DepthBufferAccess)
+					{
+						__m128i old_raw = Depth::Load(out_depth);
+						__m128i new_z = _mm_setzero_si128();
+						if (DepthTest || DepthWrite)
+							new_z = Depth::Encode(z);
+
+						// Apply stencil testing.
+						__m128i coverage = mask;
+						__m128i stencil = _mm_setzero_si128();
+						__m128i stencil_pass = coverage;
+						if (Stencil)
+						{
+							stencil = GetStencil(old_raw);
+							stencil_pass = GetStencilTestMask(draw, stencil);
+							mask = _mm_and_si128(mask, stencil_pass);
+						}
 
 						// Apply depth testing.
+						__m128i depth_pass = _mm_set1_epi32(-1);
 						if (DepthTest)
 						{
-							mask = _mm_and_si128(mask, _mm_cmpgt_epi32(old_z, new_z));
+							depth_pass = GetDepthTestMask<DepthCompare>(Depth::GetDepth(old_raw), new_z);
+							mask = _mm_and_si128(mask, depth_pass);
 
-							// Skip the block, when depth buffer occludes it completely.
-							if (_mm_movemask_epi8(mask) == 0)
+							// Skip the block, when depth buffer occludes it completely. Stencil
+							// operations still need to be applied for the failed pixels.
+							if (!Stencil && _mm_movemask_epi8(mask) == 0)
 								goto skip_block;
 						}
 
-						// Write depth output
-						if (DepthWrite)
+						// Write depth and stencil output
+						if (DepthWrite || Stencil)
 						{
-							__m128i result = _mm_or_si128(_mm_andnot_si128(mask, old_z), _mm_and_si128(mask, new_z));
-							_mm_store_si128((__m128i *)out_depth, result);
+							__m128i result = old_raw;
+							if (DepthWrite)
+								result = Depth::SetDepth(result, new_z, mask);
+							if (Stencil)
+								result = SetStencil(result, ApplyStencilOp(draw, stencil, stencil_pass, depth_pass), coverage);
+							Depth::Store(out_depth, result);
+							depth_written |= DepthWrite;
 						}
+
+						if (Stencil && _mm_movemask_epi8(mask) == 0)
+							goto skip_block;
 					}
 
+					visible_samples += CountMaskPixels(mask);
+
 					// Write color output
 					if (ColorWrite)
 					{
-						__m128 w = _mm_rcp_ps(inv_w);
-
 						__m128i old_color = _mm_load_si128((__m128i *)out_color);
-						__m128i new_color;
 
-						// Output pixel
-						if (VertexColor)
-						{
-							__m128i x = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[0], w), _mm_set1_ps(255.0f)));
-							__m128i y = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[1], w), _mm_set1_ps(255.0f)));
-							__m128i z = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(pers_color[2], w), _mm_set1_ps(255.0f)));
+						// Alpha tested color is lit after the test, so discarded pixels are not lit.
+						if (!AlphaTest)
+							new_color = ShadeBlock<DiffuseMap, VertexColor, VertexAlpha, ColorLighting, Sampler>(pers_color, pers_uv, pers_light, inv_w, mask, texture, texture_cache, lighting);
+						else if (ColorLighting != RasterizerLightingNone)
+							new_color = LightBlock<ColorLighting>(*lighting, pers_light, _mm_rcp_ps(inv_w), new_color);
 
-							new_color = _mm_or_si128(_mm_or_si128(x, _mm_slli_epi32(y, 8)), _mm_slli_epi32(z, 16));
-						}
-						else
-						{
-							new_color = mask;
-						}
+						if (BlendMode != RasterizerBlendNone)
+							new_color = BlendColor<BlendMode>(new_color, old_color);
 
 						__m128i result = _mm_or_si128(_mm_andnot_si128(mask, old_color), _mm_and_si128(mask, new_color));
 						_mm_store_si128((__m128i *)out_color, result);
@@ -438,49 +1817,449 @@ namespace nmj
 					{
 						if (ColorWrite)
 							out_color += ColorBlockBytes;
-						if (DepthWrite || DepthTest)
-							out_depth += DepthBlockBytes;
+						if (DepthBufferAccess)
+							out_depth += Depth::BlockBytes;
 
-						bcoord[0] = _mm_add_epi32(bcoord[0], bcoord_xstep[0]);
-						bcoord[1] = _mm_add_epi32(bcoord[1], bcoord_xstep[1]);
-						bcoord[2] = _mm_add_epi32(bcoord[2], bcoord_xstep[2]);
+						bcoord[0] = _mm_add_epi32(bcoord[0], tri.bcoord_xstep[0]);
+						bcoord[1] = _mm_add_epi32(bcoord[1], tri.bcoord_xstep[1]);
+						bcoord[2] = _mm_add_epi32(bcoord[2], tri.bcoord_xstep[2]);
 
 						inv_w = _mm_add_ps(inv_w, inv_w_xstep);
 
 						if (DepthWrite || DepthTest)
 							z = _mm_add_ps(z, z_xstep);
 
-						if (ColorWrite && VertexColor)
+						if (ColorShading && VertexColor)
 						{
 							pers_color[0] = _mm_add_ps(pers_color[0], pers_color_xstep[0]);
 							pers_color[1] = _mm_add_ps(pers_color[1], pers_color_xstep[1]);
 							pers_color[2] = _mm_add_ps(pers_color[2], pers_color_xstep[2]);
+							if (VertexAlpha)
+								pers_color[3] = _mm_add_ps(pers_color[3], pers_color_xstep[3]);
+						}
+
+						if (ColorShading && DiffuseMap)
+						{
+							pers_uv[0] = _mm_add_ps(pers_uv[0], pers_uv_xstep[0]);
+							pers_uv[1] = _mm_add_ps(pers_uv[1], pers_uv_xstep[1]);
+						}
+
+						if (ColorLighting != RasterizerLightingNone)
+						{
+							for (unsigned i = 0; i < LightAttributeCount; ++i)
+								pers_light[i] = _mm_add_ps(pers_light[i], pers_light_xstep[i]);
 						}
 					}
 				} // X loop
 
 				if (ColorWrite)
 					out_color_row += ColorTilePitch;
-				if (DepthWrite || DepthTest)
-					out_depth_row += DepthTilePitch;
+				if (DepthBufferAccess)
+					out_depth_row += Depth::TilePitch;
 
-				bcoord_row[0] = _mm_add_epi32(bcoord_row[0], bcoord_ystep[0]);
-				bcoord_row[1] = _mm_add_epi32(bcoord_row[1], bcoord_ystep[1]);
-				bcoord_row[2] = _mm_add_epi32(bcoord_row[2], bcoord_ystep[2]);
+				tri.bcoord_row[0] = _mm_add_epi32(tri.bcoord_row[0], tri.bcoord_ystep[0]);
+				tri.bcoord_row[1] = _mm_add_epi32(tri.bcoord_row[1], tri.bcoord_ystep[1]);
+				tri.bcoord_row[2] = _mm_add_epi32(tri.bcoord_row[2], tri.bcoord_ystep[2]);
 
 				inv_w_row = _mm_add_ps(inv_w_row, inv_w_ystep);
 
 				if (DepthWrite || DepthTest)
 					z_row = _mm_add_ps(z_row, z_ystep);
 
-				if (ColorWrite && VertexColor)
+				if (ColorShading && VertexColor)
 				{
 					pers_color_row[0] = _mm_add_ps(pers_color_row[0], pers_color_ystep[0]);
 					pers_color_row[1] = _mm_add_ps(pers_color_row[1], pers_color_ystep[1]);
 					pers_color_row[2] = _mm_add_ps(pers_color_row[2], pers_color_ystep[2]);
+					if (VertexAlpha)
+						pers_color_row[3] = _mm_add_ps(pers_color_row[3], pers_color_ystep[3]);
+				}
+
+				if (ColorShading && DiffuseMap)
+				{
+					pers_uv_row[0] = _mm_add_ps(pers_uv_row[0], pers_uv_ystep[0]);
+					pers_uv_row[1] = _mm_add_ps(pers_uv_row[1], pers_uv_ystep[1]);
+				}
+
+				if (ColorLighting != RasterizerLightingNone)
+				{
+					for (unsigned i = 0; i < LightAttributeCount; ++i)
+						pers_light_row[i] = _mm_add_ps(pers_light_row[i], pers_light_ystep[i]);
 				}
 			} // Y loop
 		} // Triangle loop
+
+		// Update the depth range of the tile. Equal test never changes the depth values.
+		if (DepthWrite && (!DepthTest || DepthCompare != RasterizerCompareEqual) && hiz && depth_written)
+			UpdateHiZ<DepthFormat>(hiz, depth_buffer);
+
+		return visible_samples;
+	}
+
+	// Dedicated rasterizer for depth only passes and occlusion queries.
+	//
+	// Only z is interpolated, so there is no perspective correct attribute setup. Triangles
+	// that fail the depth test for the whole tile are rejected before touching the depth
+	// buffer. The depth test is always enabled.
+	template <U32 DepthFormat, U32 DepthCompare, bool DepthWrite>
+	static U32 RasterizeTileDepthOnly(
+		U32 tile_x, U32 tile_y,
+		U32 screen_width, U32 screen_height,
+		void *color_buffer, void *depth_buffer, U32 *hiz,
+		const DrawState &draw, const RasterizerInput &input)
+	{
+		typedef DepthBufferFormat<DepthFormat> Depth;
+
+		TileSetup tile;
+		SetupTile(tile, tile_x, tile_y, screen_width, screen_height, input);
+
+		const float *vertices = input.vertices;
+		const U16 *indices = input.indices;
+
+		bool depth_written = false;
+
+		U32 visible_samples = 0;
+
+		for (U32 count = input.triangle_count; count--; indices += 3)
+		{
+			TriangleSetup tri;
+			if (!SetupTriangle(tri, tile, vertices, indices))
+				continue;
+
+			const float (&v)[3][4] = tri.v;
+
+			// Z interpolation
+			__m128 z_row, z_xstep, z_ystep;
+			{
+				__m128 z0 = _mm_mul_ps(_mm_set1_ps(v[0][2]), _mm_rcp_ps(_mm_set1_ps(v[0][3])));
+				__m128 z1 = _mm_mul_ps(_mm_set1_ps(v[1][2]), _mm_rcp_ps(_mm_set1_ps(v[1][3])));
+				__m128 z2 = _mm_mul_ps(_mm_set1_ps(v[2][2]), _mm_rcp_ps(_mm_set1_ps(v[2][3])));
+
+				if (IsOccludedByHiZ<DepthFormat, DepthCompare>(z0, z1, z2, hiz))
+					continue;
+
+				SetupLinearAttribute(tri, z0, z1, z2, z_row, z_xstep, z_ystep);
+			}
+
+			char *out_depth_row = (char *)depth_buffer;
+			out_depth_row += tri.block_offset_y * Depth::TilePitch + tri.block_offset_x * Depth::BlockBytes;
+
+			for (S32 y = tri.ycount; y--; )
+			{
+				char *out_depth = out_depth_row;
+				__m128i bcoord0 = tri.bcoord_row[0];
+				__m128i bcoord1 = tri.bcoord_row[1];
+				__m128i bcoord2 = tri.bcoord_row[2];
+				__m128 z = z_row;
+
+				for (S32 x = tri.xcount; x--; )
+				{
+					__m128i mask = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(bcoord0, bcoord1), bcoord2), _mm_setzero_si128());
+					if (_mm_movemask_epi8(mask) != 0)
+					{
+						__m128i old_raw = Depth::Load(out_depth);
+						__m128i new_z = Depth::Encode(z);
+						mask = _mm_and_si128(mask, GetDepthTestMask<DepthCompare>(Depth::GetDepth(old_raw), new_z));
+						visible_samples += CountMaskPixels(mask);
+
+						if (DepthWrite && _mm_movemask_epi8(mask) != 0)
+						{
+							Depth::Store(out_depth, Depth::SetDepth(old_raw, new_z, mask));
+							depth_written = true;
+						}
+					}
+
+					out_depth += Depth::BlockBytes;
+					bcoord0 = _mm_add_epi32(bcoord0, tri.bcoord_xstep[0]);
+					bcoord1 = _mm_add_epi32(bcoord1, tri.bcoord_xstep[1]);
+					bcoord2 = _mm_add_epi32(bcoord2, tri.bcoord_xstep[2]);
+					z = _mm_add_ps(z, z_xstep);
+				}
+
+				out_depth_row += Depth::TilePitch;
+				tri.bcoord_row[0] = _mm_add_epi32(tri.bcoord_row[0], tri.bcoord_ystep[0]);
+				tri.bcoord_row[1] = _mm_add_epi32(tri.bcoord_row[1], tri.bcoord_ystep[1]);
+				tri.bcoord_row[2] = _mm_add_epi32(tri.bcoord_row[2], tri.bcoord_ystep[2]);
+				z_row = _mm_add_ps(z_row, z_ystep);
+			}
+		}
+
+		// Update the depth range of the tile. Equal test never changes the depth values.
+		if (DepthWrite && DepthCompare != RasterizerCompareEqual && hiz && depth_written)
+			UpdateHiZ<DepthFormat>(hiz, depth_buffer);
+
+		return visible_samples;
+	}
+
+	// Number of sampler variants of the DiffuseMap pipelines.
+	enum
+	{
+		SamplerAddressModeCount = 3,
+		SamplerFilterCount = 2
+	};
+
+	// Layout of the pipeline index, which packs the whole pipeline state into one
+	// integer. Fields are stored in mixed radix, fastest varying first:
+	//
+	//     [VertexColor << 4 | DiffuseMap << 3 | DepthTest << 2 | DepthWrite << 1 | ColorWrite]
+	//     [BlendMode]
+	//     [Filter]
+	//     [AddressMode]
+	//     [DepthCompare]
+	//     [DepthFormat]
+	//     [Stencil]
+	//     [AlphaTest]
+	//     [Lighting]
+	enum
+	{
+		PipelineFlagCount = 32,
+		PipelineBlendModeCount = 5,
+		PipelineDepthCompareCount = 5,
+		PipelineDepthFormatCount = 3,
+		PipelineLightingCount = 3,
+
+		PipelineBlendModeStride = 1 * PipelineFlagCount,
+		PipelineFilterStride = PipelineBlendModeStride * PipelineBlendModeCount,
+		PipelineAddressModeStride = PipelineFilterStride * SamplerFilterCount,
+		PipelineDepthCompareStride = PipelineAddressModeStride * SamplerAddressModeCount,
+		PipelineDepthFormatStride = PipelineDepthCompareStride * PipelineDepthCompareCount,
+		PipelineStencilStride = PipelineDepthFormatStride * PipelineDepthFormatCount,
+		PipelineAlphaTestStride = PipelineStencilStride * 2,
+		PipelineLightingStride = PipelineAlphaTestStride * 2,
+		PipelineCount = PipelineLightingStride * PipelineLightingCount
+	};
+
+	// Get the pipeline index from the pipeline state.
+	NMJ_FORCEINLINE U32 GetPipelineIndex(U32 flags, U32 blend_mode, U32 address_mode, U32 filter, U32 depth_compare, U32 depth_format, bool stencil, bool alpha_test, U32 lighting)
+	{
+		NMJ_ASSERT(flags < PipelineFlagCount);
+		NMJ_ASSERT(blend_mode < PipelineBlendModeCount);
+		NMJ_ASSERT(address_mode < SamplerAddressModeCount);
+		NMJ_ASSERT(filter < SamplerFilterCount);
+		NMJ_ASSERT(depth_compare < PipelineDepthCompareCount);
+		NMJ_ASSERT(depth_format < PipelineDepthFormatCount);
+		NMJ_ASSERT(lighting < PipelineLightingCount);
+
+		return
+			flags +
+			blend_mode * PipelineBlendModeStride +
+			filter * PipelineFilterStride +
+			address_mode * PipelineAddressModeStride +
+			depth_compare * PipelineDepthCompareStride +
+			depth_format * PipelineDepthFormatStride +
+			(stencil ? PipelineStencilStride : 0) +
+			(alpha_test ? PipelineAlphaTestStride : 0) +
+			lighting * PipelineLightingStride;
+	}
+
+	// Pipeline state decoded from the pipeline index.
+	//
+	// The state is canonicalized, so that the states which can't affect the result map
+	// to the same kernel. This way only the distinct kernels get instantiated, no matter
+	// how many entries the pipeline table has.
+	template <U32 Index>
+	struct PipelineDesc
+	{
+		enum
+		{
+			// Raw fields of the index.
+			RawColorWrite = (Index & RasterizerFlagColorWrite) != 0,
+			RawDepthWrite = (Index & RasterizerFlagDepthWrite) != 0,
+			RawDepthTest = (Index & RasterizerFlagDepthTest) != 0,
+			RawDiffuseMap = (Index & (1 << 3)) != 0,
+			RawVertexColor = (Index & (1 << 4)) != 0,
+			RawBlendMode = Index / PipelineBlendModeStride % PipelineBlendModeCount,
+			RawFilter = Index / PipelineFilterStride % SamplerFilterCount,
+			RawAddressMode = Index / PipelineAddressModeStride % SamplerAddressModeCount,
+			RawDepthCompare = Index / PipelineDepthCompareStride % PipelineDepthCompareCount,
+			RawDepthFormat = Index / PipelineDepthFormatStride % PipelineDepthFormatCount,
+			RawStencil = Index / PipelineStencilStride % 2 != 0,
+			RawAlphaTest = Index / PipelineAlphaTestStride % 2 != 0,
+			RawLighting = Index / PipelineLightingStride,
+
+			// Alpha test needs the alpha from the attributes.
+			AlphaTest = RawAlphaTest && (RawDiffuseMap || RawVertexColor),
+
+			// Attributes are only used for the color and the alpha test.
+			ColorWrite = RawColorWrite,
+			DepthWrite = RawDepthWrite,
+			DepthTest = RawDepthTest,
+			DiffuseMap = (ColorWrite || AlphaTest) && RawDiffuseMap,
+			VertexColor = (ColorWrite || AlphaTest) && RawVertexColor,
+			BlendMode = ColorWrite ? RawBlendMode : RasterizerBlendNone,
+			Lighting = ColorWrite ? RawLighting : RasterizerLightingNone,
+
+			// Stencil is only stored in D24S8 format.
+			Stencil = RawStencil && RawDepthFormat == RasterizerDepthFormatD24S8,
+
+			// Sampler only matters with the diffuse map.
+			Filter = DiffuseMap ? RawFilter : RasterizerFilterBilinear,
+			AddressMode = DiffuseMap ? RawAddressMode : RasterizerAddressWrap,
+
+			// Depth buffer only matters, when it's accessed.
+			DepthCompare = DepthTest ? RawDepthCompare : RasterizerCompareLess,
+			DepthFormat = DepthTest || DepthWrite || Stencil ? RawDepthFormat : RasterizerDepthFormatD24S8,
+
+			// Depth only kernel doesn't handle stencil or alpha test, so the general one is used with them.
+			DepthOnly = !ColorWrite && DepthTest && !Stencil && !AlphaTest,
+
+			// Index of the canonical state.
+			Key =
+				ColorWrite * RasterizerFlagColorWrite +
+				DepthWrite * RasterizerFlagDepthWrite +
+				DepthTest * RasterizerFlagDepthTest +
+				DiffuseMap * (1 << 3) +
+				VertexColor * (1 << 4) +
+				BlendMode * PipelineBlendModeStride +
+				Filter * PipelineFilterStride +
+				AddressMode * PipelineAddressModeStride +
+				DepthCompare * PipelineDepthCompareStride +
+				DepthFormat * PipelineDepthFormatStride +
+				Stencil * PipelineStencilStride +
+				AlphaTest * PipelineAlphaTestStride +
+				Lighting * PipelineLightingStride
+		};
+	};
+
+	// Kernel for the canonical pipeline state.
+	template <U32 Key, bool DepthOnly = PipelineDesc<Key>::DepthOnly != 0>
+	struct PipelineKernel
+	{
+		typedef PipelineDesc<Key> Desc;
+		NMJ_STATIC_ASSERT(U32(Desc::Key) == Key, "Pipeline kernel must use the canonical state.");
+
+		static U32 Rasterize(
+			U32 tile_x, U32 tile_y,
+			U32 screen_width, U32 screen_height,
+			void *color_buffer, void *depth_buffer, U32 *hiz,
+			const DrawState &draw, const RasterizerInput &input)
+		{
+			return RasterizeTile<
+				Desc::ColorWrite != 0, Desc::DepthWrite != 0, Desc::DepthTest != 0, Desc::DiffuseMap != 0, Desc::VertexColor != 0, Desc::BlendMode, Desc::AlphaTest != 0, Desc::Lighting,
+				Desc::DepthFormat, Desc::DepthCompare, Desc::Stencil != 0,
+				TextureSampler<Desc::AddressMode, Desc::Filter> >(
+					tile_x, tile_y, screen_width, screen_height, color_buffer, depth_buffer, hiz, draw, input);
+		}
+	};
+
+	template <U32 Key>
+	struct PipelineKernel<Key, true>
+	{
+		typedef PipelineDesc<Key> Desc;
+		NMJ_STATIC_ASSERT(U32(Desc::Key) == Key, "Pipeline kernel must use the canonical state.");
+
+		static U32 Rasterize(
+			U32 tile_x, U32 tile_y,
+			U32 screen_width, U32 screen_height,
+			void *color_buffer, void *depth_buffer, U32 *hiz,
+			const DrawState &draw, const RasterizerInput &input)
+		{
+			return RasterizeTileDepthOnly<Desc::DepthFormat, Desc::DepthCompare, Desc::DepthWrite != 0>(
+				tile_x, tile_y, screen_width, screen_height, color_buffer, depth_buffer, hiz, draw, input);
+		}
+	};
+
+	// Compile-time list of indices.
+	template <U32... Indices>
+	struct IndexList
+	{
+	};
+
+	// Append the second list after the first one, offsetting its indices.
+	template <typename A, typename B>
+	struct ConcatIndexList;
+
+	template <U32... A, U32... B>
+	struct ConcatIndexList<IndexList<A...>, IndexList<B...> >
+	{
+		typedef IndexList<A..., (U32(sizeof...(A)) + B)...> Type;
+	};
+
+	// Generate the list [0, Count) by halving, so the recursion stays shallow.
+	template <U32 Count>
+	struct MakeIndexList
+	{
+		typedef typename ConcatIndexList<
+			typename MakeIndexList<Count / 2>::Type,
+			typename MakeIndexList<Count - Count / 2>::Type>::Type Type;
+	};
+
+	template <>
+	struct MakeIndexList<0>
+	{
+		typedef IndexList<> Type;
+	};
+
+	template <>
+	struct MakeIndexList<1>
+	{
+		typedef IndexList<0> Type;
+	};
+
+	// Pipeline table generated from the index list.
+	template <typename List>
+	struct PipelineTable;
+
+	template <U32... Indices>
+	struct PipelineTable<IndexList<Indices...> >
+	{
+		// [GetPipelineIndex()]
+		static RasterizeTileFunc *const table[sizeof...(Indices)];
+	};
+
+	template <U32... Indices>
+	RasterizeTileFunc *const PipelineTable<IndexList<Indices...> >::table[sizeof...(Indices)] =
+	{
+		&PipelineKernel<PipelineDesc<Indices>::Key>::Rasterize...
+	};
+
+	typedef PipelineTable<MakeIndexList<PipelineCount>::Type> Pipelines;
+
+	// Prepare the stencil constants of the draw state.
+	static void SetupStencil(DrawState &draw, const RasterizerState &state)
+	{
+		draw.stencil_ref = _mm_set1_epi32(state.stencil_ref & state.stencil_read_mask);
+		draw.stencil_read_mask = _mm_set1_epi32(state.stencil_read_mask);
+		draw.stencil_write_mask = _mm_set1_epi32(state.stencil_write_mask);
+
+		// Results of the reference compared to the stencil value, that pass the test.
+		bool less = false, equal = false, greater = false;
+		switch (state.stencil_compare)
+		{
+			case RasterizerCompareLess: less = true; break;
+			case RasterizerCompareLessEqual: less = equal = true; break;
+			case RasterizerCompareGreater: greater = true; break;
+			case RasterizerCompareEqual: equal = true; break;
+			default:
+				NMJ_ASSERT(state.stencil_compare == RasterizerCompareAlways);
+				less = equal = greater = true;
+				break;
+		}
+		draw.stencil_test_less = _mm_set1_epi32(less ? -1 : 0);
+		draw.stencil_test_equal = _mm_set1_epi32(equal ? -1 : 0);
+		draw.stencil_test_greater = _mm_set1_epi32(greater ? -1 : 0);
+
+		// Operations for [fail, depth fail, pass].
+		const U32 ops[3] = { state.stencil_fail_op, state.stencil_depth_fail_op, state.stencil_pass_op };
+		for (U32 i = 0; i < 3; ++i)
+		{
+			S32 op_and = 0xFF, op_xor = 0, op_add = 0;
+			switch (ops[i])
+			{
+				case RasterizerStencilZero: op_and = 0; break;
+				case RasterizerStencilReplace: op_and = 0; op_xor = state.stencil_ref; break;
+				case RasterizerStencilIncr: op_add = 1; break;
+				case RasterizerStencilDecr: op_add = -1; break;
+				case RasterizerStencilInvert: op_xor = 0xFF; break;
+				default: NMJ_ASSERT(ops[i] == RasterizerStencilKeep); break;
+			}
+
+			draw.stencil_op_and[i] = _mm_set1_epi32(op_and);
+			draw.stencil_op_xor[i] = _mm_set1_epi32(op_xor);
+			draw.stencil_op_add[i] = _mm_set1_epi32(op_add);
+		}
+
+		draw.stencil_allows_hiz = state.stencil_fail_op == RasterizerStencilKeep && state.stencil_depth_fail_op == RasterizerStencilKeep;
 	}
 
 	U32 GetRequiredMemoryAmount(const RasterizerOutput &self, bool color, bool depth)
@@ -502,8 +2281,11 @@ namespace nmj
 		{
 			ret = GetAligned(ret, 16u);
 
-			U32 pitch = width * DepthTileBytes;
+			U32 pitch = width * GetDepthTileBytes(self.depth_format);
 			ret += pitch * height;
+
+			// Hierarchical depth buffer
+			ret += width * height * sizeof(U32) * 2;
 		}
 
 		// Bins
@@ -541,9 +2323,17 @@ namespace nmj
 		{
 			alloc_stack = GetAligned(alloc_stack, 16u);
 
-			U32 pitch = width * DepthTileBytes;
+			U32 pitch = width * GetDepthTileBytes(self.depth_format);
 			self.depth_buffer = alloc_stack;
 			alloc_stack += pitch * height;
+
+			// Hierarchical depth buffer
+			self.hiz_buffer = (U32 *)alloc_stack;
+			alloc_stack += width * height * sizeof(U32) * 2;
+		}
+		else
+		{
+			self.hiz_buffer = NULL;
 		}
 
 		// Bins
@@ -560,89 +2350,203 @@ namespace nmj
 #endif
 	}
 
-	void Rasterize(RasterizerState &state, const RasterizerInput *input, U32 input_count, U32 split_index, U32 num_splits)
+	U32 GetRequiredMemoryAmount(const RasterizerTexture &self, bool mipmaps)
 	{
-		// [VertexColor << 4 | DiffuseMap << 3 | ColorWrite << 2 | DepthWrite << 1 | DepthTest]
-		static RasterizeTileFunc *pipeline[] =
-		{
-			&RasterizeTile<0, 0, 0, 0, 0>,
-			&RasterizeTile<1, 0, 0, 0, 0>,
-			&RasterizeTile<0, 1, 0, 0, 0>,
-			&RasterizeTile<1, 1, 0, 0, 0>,
-			&RasterizeTile<0, 0, 1, 0, 0>,
-			&RasterizeTile<1, 0, 1, 0, 0>,
-			&RasterizeTile<0, 1, 1, 0, 0>,
-			&RasterizeTile<1, 1, 1, 0, 0>,
-			&RasterizeTile<0, 0, 0, 1, 0>,
-			&RasterizeTile<1, 0, 0, 1, 0>,
-			&RasterizeTile<0, 1, 0, 1, 0>,
-			&RasterizeTile<1, 1, 0, 1, 0>,
-			&RasterizeTile<0, 0, 1, 1, 0>,
-			&RasterizeTile<1, 0, 1, 1, 0>,
-			&RasterizeTile<0, 1, 1, 1, 0>,
-			&RasterizeTile<1, 1, 1, 1, 0>,
-			&RasterizeTile<0, 0, 0, 0, 1>,
-			&RasterizeTile<1, 0, 0, 0, 1>,
-			&RasterizeTile<0, 1, 0, 0, 1>,
-			&RasterizeTile<1, 1, 0, 0, 1>,
-			&RasterizeTile<0, 0, 1, 0, 1>,
-			&RasterizeTile<1, 0, 1, 0, 1>,
-			&RasterizeTile<0, 1, 1, 0, 1>,
-			&RasterizeTile<1, 1, 1, 0, 1>,
-			&RasterizeTile<0, 0, 0, 1, 1>,
-			&RasterizeTile<1, 0, 0, 1, 1>,
-			&RasterizeTile<0, 1, 0, 1, 1>,
-			&RasterizeTile<1, 1, 0, 1, 1>,
-			&RasterizeTile<0, 0, 1, 1, 1>,
-			&RasterizeTile<1, 0, 1, 1, 1>,
-			&RasterizeTile<0, 1, 1, 1, 1>,
-			&RasterizeTile<1, 1, 1, 1, 1>
-		};
+		const U32 level_count = mipmaps ? GetTextureLevelCount(self.width, self.height) : 1;
+
+		U32 size = 0;
+		for (U32 level = 0; level < level_count; ++level)
+			size += GetTextureLevelBytes(self.format, self.width, self.height, level);
+
+		return size;
+	}
+
+	void GenerateMipChain(RasterizerTexture &self, U32 *texels)
+	{
+		NMJ_ASSERT(self.format == RasterizerTextureFormatRGBA8);
+
+		const U32 level_count = GetTextureLevelCount(self.width, self.height);
+
+		U32 *src = texels;
+		U32 src_width = self.width;
+		U32 src_height = self.height;
+		for (U32 level = 1; level < level_count; ++level)
+		{
+			const U32 width = GetTextureLevelSize(self.width, level);
+			const U32 height = GetTextureLevelSize(self.height, level);
+
+			U32 *dst = src + src_width * src_height;
+			DownsampleTextureLevel(dst, width, height, src, src_width, src_height);
+
+			src = dst;
+			src_width = width;
+			src_height = height;
+		}
+
+		self.texels = texels;
+		self.mip_count = U8(level_count);
+	}
+
+	void ConvertToTiledLayout(RasterizerTexture &self, U32 *tiled_texels)
+	{
+		NMJ_ASSERT(self.format == RasterizerTextureFormatRGBA8);
+		NMJ_ASSERT(self.layout == RasterizerTextureLayoutLinear);
+
+		const U32 mip_count = U32(Max(self.mip_count, 1));
+		const U32 *src = (const U32 *)self.texels;
+		U32 *dst = tiled_texels;
+		for (U32 level = 0; level < mip_count; ++level)
+		{
+			const U32 width = GetTextureLevelSize(self.width, level);
+			const U32 height = GetTextureLevelSize(self.height, level);
+			const U32 width_shift = GetLog2(width);
+			const U32 height_shift = GetLog2(height);
+
+			U32 tile_shift_x, tile_shift_y;
+			GetTextureTileShift(RasterizerTextureLayoutTiled, width_shift, height_shift, tile_shift_x, tile_shift_y);
+
+			if (tile_shift_x == TextureTileShift && tile_shift_y == TextureTileShift)
+			{
+				// Copy full 4x4 tiles row by row.
+				U32 *out = dst;
+				for (U32 y = 0; y < height; y += 4)
+				{
+					for (U32 x = 0; x < width; x += 4)
+					{
+						const U32 *in = src + y * width + x;
+						_mm_storeu_si128((__m128i *)(out + 0), _mm_loadu_si128((const __m128i *)(in + width * 0)));
+						_mm_storeu_si128((__m128i *)(out + 4), _mm_loadu_si128((const __m128i *)(in + width * 1)));
+						_mm_storeu_si128((__m128i *)(out + 8), _mm_loadu_si128((const __m128i *)(in + width * 2)));
+						_mm_storeu_si128((__m128i *)(out + 12), _mm_loadu_si128((const __m128i *)(in + width * 3)));
+						out += 16;
+					}
+				}
+			}
+			else
+			{
+				// Narrow levels with smaller tiles.
+				const U32 tile_texel_shift = tile_shift_x + tile_shift_y;
+				const U32 tile_row_shift = width_shift - tile_shift_x;
+				for (U32 y = 0; y < height; ++y)
+				{
+					for (U32 x = 0; x < width; ++x)
+					{
+						const U32 tile = ((y >> tile_shift_y) << tile_row_shift) + (x >> tile_shift_x);
+						const U32 texel = ((y & ((1 << tile_shift_y) - 1)) << tile_shift_x) | (x & ((1 << tile_shift_x) - 1));
+						dst[(tile << tile_texel_shift) | texel] = src[y * width + x];
+					}
+				}
+			}
+
+			src += width * height;
+			dst += width * height;
+		}
+
+		self.texels = tiled_texels;
+		self.layout = RasterizerTextureLayoutTiled;
+	}
 
+	void Rasterize(RasterizerState &state, const RasterizerInput *input, U32 input_count, U32 split_index, U32 num_splits)
+	{
 		// General settings
 		const U32 screen_width = state.output->width;
 		const U32 screen_height = state.output->height;
 		U32 flags = state.flags & 7;
+		bool stencil = (state.flags & RasterizerFlagStencilTest) != 0;
+		const bool alpha_test = (state.flags & RasterizerFlagAlphaTest) != 0;
 
 		// Validate buffers
 		char *color_buffer = (char *)state.output->color_buffer;
 		char *depth_buffer = (char *)state.output->depth_buffer;
+		U32 *hiz_buffer = state.output->hiz_buffer;
 		if (color_buffer == NULL)
 			flags &= ~RasterizerFlagColorWrite;
 		if (depth_buffer == NULL)
-			flags &= ~RasterizerFlagDepthWrite;
+			flags &= ~(RasterizerFlagDepthWrite | RasterizerFlagDepthTest);
+		if (depth_buffer == NULL || state.output->depth_format != RasterizerDepthFormatD24S8)
+			stencil = false;
 
 		// Tile information
 		const U32 x_tile_count = DivWithRoundUp<U32>(screen_width, TileSizeX);
 		const U32 y_tile_count = DivWithRoundUp<U32>(screen_height, TileSizeY);
 		const U32 tile_count = x_tile_count * y_tile_count;
 
+		// Pipeline state shared by all the inputs.
+		const U32 depth_format = state.output->depth_format;
+		const U32 depth_tile_bytes = GetDepthTileBytes(depth_format);
+		const U32 depth_compare = state.depth_compare;
+		const U32 blend_mode = state.blend_mode;
+
+		DrawState draw;
+		if (stencil)
+			SetupStencil(draw, state);
+		draw.alpha_ref = _mm_set1_epi32(state.alpha_ref);
+
+		NMJ_ASSERT(state.query == NULL || split_index < RasterizerMaxSplits);
+		U32 visible_samples = 0;
+
 		while (input_count--)
 		{
 			const RasterizerInput &ri = *input++;
 
 			// Get rasterizer function.
-			RasterizeTileFunc *RasterizeTile;
+			U32 lookup_flags = flags;
+			U32 address_mode = RasterizerAddressWrap;
+			U32 filter = RasterizerFilterBilinear;
+			if (ri.colors)
+				lookup_flags |= 1 << 4;
+			if (ri.texcoords && ri.diffuse_map)
 			{
-				U32 lookup_index = flags;
-				if (ri.colors)
-					lookup_index |= 1 << 4;
-				if (ri.texcoords)
-					lookup_index |= 1 << 3;
-
-				RasterizeTile = pipeline[lookup_index];
+				lookup_flags |= 1 << 3;
+				address_mode = ri.diffuse_sampler.address_mode;
+				filter = ri.diffuse_sampler.filter;
 			}
+			U32 lighting = RasterizerLightingNone;
+			if (ri.normals && ri.lighting)
+				lighting = ri.lighting->model;
+
+			RasterizeTileFunc *RasterizeTile = Pipelines::table[GetPipelineIndex(lookup_flags, blend_mode, address_mode, filter, depth_compare, depth_format, stencil, alpha_test, lighting)];
 
 			char *out_color = color_buffer + split_index * ColorTileBytes;
-			char *out_depth = depth_buffer + split_index * DepthTileBytes;
+			char *out_depth = depth_buffer + split_index * depth_tile_bytes;
 			for (U32 index = split_index; index < tile_count; index += num_splits)
 			{
-				RasterizeTile(index % x_tile_count, index / x_tile_count, screen_width, screen_height, out_color, out_depth, ri);
+				U32 *hiz = hiz_buffer ? hiz_buffer + index * 2 : NULL;
+				visible_samples += RasterizeTile(index % x_tile_count, index / x_tile_count, screen_width, screen_height, out_color, out_depth, hiz, draw, ri);
 
 				out_color += ColorTileBytes * num_splits;
-				out_depth += DepthTileBytes * num_splits;
+				out_depth += depth_tile_bytes * num_splits;
 			}
 		}
+
+		if (state.query)
+			state.query->counters[split_index].samples += visible_samples;
+	}
+
+	void BeginQuery(RasterizerState &state, RasterizerQuery &query, U32 split_index)
+	{
+		NMJ_ASSERT(split_index < RasterizerMaxSplits);
+		NMJ_ASSERT(state.query == NULL);
+
+		query.counters[split_index].samples = 0;
+		state.query = &query;
+	}
+
+	void EndQuery(RasterizerState &state)
+	{
+		NMJ_ASSERT(state.query != NULL);
+
+		state.query = NULL;
+	}
+
+	U32 GetQueryResult(const RasterizerQuery &query, U32 num_splits)
+	{
+		NMJ_ASSERT(num_splits <= RasterizerMaxSplits);
+
+		U32 samples = 0;
+		for (U32 i = 0; i < num_splits; ++i)
+			samples += query.counters[i].samples;
+		return samples;
 	}
 
 	void ClearColor(RasterizerOutput &output, float r, float g, float b, float a, U32 split_index, U32 num_splits)
@@ -666,24 +2570,52 @@ namespace nmj
 		}
 	}
 
-	void ClearDepth(RasterizerOutput &output, float depth, U8 stencil, U32 split_index, U32 num_splits)
+	template <U32 DepthFormat>
+	static void ClearDepthTiles(RasterizerOutput &output, float depth, U8 stencil, U32 split_index, U32 num_splits)
 	{
+		typedef DepthBufferFormat<DepthFormat> Depth;
+		NMJ_STATIC_ASSERT(Depth::TileBytes % 16 == 0, "Update this function.");
+
 		const U32 x_tile_count = DivWithRoundUp<U32>(output.width, TileSizeX);
 		const U32 y_tile_count = DivWithRoundUp<U32>(output.height, TileSizeY);
 		const U32 tile_count = x_tile_count * y_tile_count;
 
-		__m128i cv = _mm_set1_epi32(U32(depth * float(0xFFFFFF)) | stencil << 24);
+		const U32 depth_value = U32(Depth::Encode(depth));
+		__m128i cv = Depth::GetClearValue(depth, stencil);
 
-		char *out = ((char *)output.depth_buffer) + split_index * DepthTileBytes;
+		char *out = ((char *)output.depth_buffer) + split_index * Depth::TileBytes;
 		for (U32 index = split_index; index < tile_count; index += num_splits)
 		{
-			for (U32 count = TileSizeXInBlocks * TileSizeYInBlocks; count--; )
+			if (output.hiz_buffer)
+			{
+				output.hiz_buffer[index * 2 + 0] = depth_value;
+				output.hiz_buffer[index * 2 + 1] = depth_value;
+			}
+
+			for (U32 count = Depth::TileBytes / 16; count--; )
 			{
 				_mm_store_si128((__m128i *)out, cv);
-				out += DepthBlockBytes;
+				out += 16;
 			}
 
-			out += (num_splits - 1) * DepthTileBytes;
+			out += (num_splits - 1) * Depth::TileBytes;
+		}
+	}
+
+	void ClearDepth(RasterizerOutput &output, float depth, U8 stencil, U32 split_index, U32 num_splits)
+	{
+		switch (output.depth_format)
+		{
+			case RasterizerDepthFormatD16:
+				ClearDepthTiles<RasterizerDepthFormatD16>(output, depth, stencil, split_index, num_splits);
+				break;
+			case RasterizerDepthFormatD32F:
+				ClearDepthTiles<RasterizerDepthFormatD32F>(output, depth, stencil, split_index, num_splits);
+				break;
+			default:
+				NMJ_ASSERT(output.depth_format == RasterizerDepthFormatD24S8);
+				ClearDepthTiles<RasterizerDepthFormatD24S8>(output, depth, stencil, split_index, num_splits);
+				break;
 		}
 	}
 
@@ -163,6 +163,17 @@ namespace nmj
 			RasterizerState state;
 			state.flags = RasterizerFlagColorWrite | RasterizerFlagDepthWrite | RasterizerFlagDepthTest;
 			state.output = &app.framebuffer;
+			state.depth_compare = RasterizerCompareLess;
+			state.blend_mode = RasterizerBlendNone;
+			state.alpha_ref = 0;
+			state.stencil_compare = RasterizerCompareAlways;
+			state.stencil_fail_op = RasterizerStencilKeep;
+			state.stencil_depth_fail_op = RasterizerStencilKeep;
+			state.stencil_pass_op = RasterizerStencilKeep;
+			state.stencil_ref = 0;
+			state.stencil_read_mask = 0xFF;
+			state.stencil_write_mask = 0xFF;
+			state.query = NULL;
 			Rasterize(state, app.rasterizer_input.data(), U32(app.rasterizer_input.size()), thread_index, DefaultThreadAmount);
 
 			// Blit to screen.
@@ -274,6 +285,9 @@ namespace nmj
 			ri.vertices = model->vertex_pos;
 			ri.colors = model->vertex_color;
 			ri.texcoords = NULL;
+			ri.normals = NULL;
+			ri.diffuse_map = NULL;
+			ri.lighting = NULL;
 			ri.indices = model->indices;
 			ri.triangle_count = model->triangle_count;
 
@@ -378,6 +392,7 @@ namespace nmj
 			// Default framebuffer
 			app.framebuffer.width = 1280;
 			app.framebuffer.height = 720;
+			app.framebuffer.depth_format = RasterizerDepthFormatD24S8;
 			U32 size = GetRequiredMemoryAmount(app.framebuffer, true, true);
 			Initialize(app.framebuffer, malloc(size), true, true);
 